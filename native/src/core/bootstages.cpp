@@ -15,6 +15,7 @@
 using namespace std;
 
 bool zygisk_enabled = false;
+int mount_mode = MOUNT_MODE_MAGIC;
 
 /*********
  * Setup *
@@ -74,6 +75,14 @@ static void mount_mirrors() {
         if (!mounted) {
             LOGW("preinit mirror not mounted %u:%u\n", major(preinit_dev), minor(preinit_dev));
             unlink(dev_path);
+        } else if (auto cache = get_magisk_tmp() + "/"s SEPOLCACHE; access(cache.data(), F_OK) == 0) {
+            // Keep the policy magiskinit patched during this boot for the next boot
+            auto dest = get_magisk_tmp() + "/"s PREINITSEPOL;
+            auto tmp = dest + ".tmp";
+            cp_afc(cache.data(), tmp.data());
+            if (rename(tmp.data(), dest.data()) == 0)
+                LOGD("sepolicy cache: %s\n", dest.data());
+            unlink(cache.data());
         }
     }
 
@@ -334,8 +343,9 @@ bool MagiskD::post_fs_data() const {
     } else {
         exec_common_scripts("post-fs-data");
         db_settings dbs;
-        get_db_settings(dbs, ZYGISK_CONFIG);
+        get_db_settings(dbs);
         zygisk_enabled = dbs[ZYGISK_CONFIG];
+        mount_mode = dbs[MOUNT_MODE];
         initialize_denylist();
         handle_modules();
     }
@@ -15,6 +15,13 @@ struct sqlite3;
 
 static sqlite3 *mDB = nullptr;
 
+// Guards mDB and all cached statements.
+// Recursive so that queries can be issued within db_transaction.
+static pthread_mutex_t db_lock = PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP;
+
+// SQL string -> prepared statement
+static map<string, sqlite3_stmt *, StringCmp> stmt_cache;
+
 #define DBLOGV(...)
 //#define DBLOGV(...) LOGD("magiskdb: " __VA_ARGS__)
 
@@ -24,6 +31,14 @@ static sqlite3 *mDB = nullptr;
 #define SQLITE_OPEN_CREATE           0x00000004  /* Ok for sqlite3_open_v2() */
 #define SQLITE_OPEN_FULLMUTEX        0x00010000  /* Ok for sqlite3_open_v2() */
 
+#define SQLITE_OK           0   /* Successful result */
+#define SQLITE_ROW          100 /* sqlite3_step() has another row ready */
+#define SQLITE_DONE         101 /* sqlite3_step() has finished executing */
+
+#define SQLITE_PREPARE_PERSISTENT    0x01
+
+#define SQLITE_STATIC      ((void(*)(void *)) 0)
+
 static int (*sqlite3_open_v2)(
         const char *filename,
         sqlite3 **ppDb,
@@ -39,6 +54,33 @@ static int (*sqlite3_exec)(
         void *v,
         char **errmsg);
 
+// Prepared statement APIs
+static int (*sqlite3_prepare_v2)(
+        sqlite3 *db,
+        const char *zSql,
+        int nByte,
+        sqlite3_stmt **ppStmt,
+        const char **pzTail);
+// Only available since SQLite 3.20 (Android 9.0), optional
+static int (*sqlite3_prepare_v3)(
+        sqlite3 *db,
+        const char *zSql,
+        int nByte,
+        unsigned int prepFlags,
+        sqlite3_stmt **ppStmt,
+        const char **pzTail);
+static int (*sqlite3_bind_int64)(sqlite3_stmt*, int, int64_t);
+static int (*sqlite3_bind_text)(sqlite3_stmt*, int, const char*, int, void(*)(void*));
+static int (*sqlite3_bind_parameter_count)(sqlite3_stmt*);
+static int (*sqlite3_step)(sqlite3_stmt*);
+static int (*sqlite3_reset)(sqlite3_stmt*);
+static int (*sqlite3_finalize)(sqlite3_stmt*);
+static int (*sqlite3_column_count)(sqlite3_stmt*);
+static const char *(*sqlite3_column_name)(sqlite3_stmt*, int);
+static int (*sqlite3_column_int)(sqlite3_stmt*, int);
+static const unsigned char *(*sqlite3_column_text)(sqlite3_stmt*, int);
+static int (*sqlite3_column_bytes)(sqlite3_stmt*, int);
+
 // Internal Android linker APIs
 
 static void (*android_get_LD_LIBRARY_PATH)(char *buffer, size_t buffer_size);
@@ -95,6 +137,20 @@ static bool dload_sqlite() {
     DLOAD(sqlite, sqlite3_close);
     DLOAD(sqlite, sqlite3_exec);
     DLOAD(sqlite, sqlite3_free);
+    DLOAD(sqlite, sqlite3_prepare_v2);
+    DLOAD(sqlite, sqlite3_bind_int64);
+    DLOAD(sqlite, sqlite3_bind_text);
+    DLOAD(sqlite, sqlite3_bind_parameter_count);
+    DLOAD(sqlite, sqlite3_step);
+    DLOAD(sqlite, sqlite3_reset);
+    DLOAD(sqlite, sqlite3_finalize);
+    DLOAD(sqlite, sqlite3_column_count);
+    DLOAD(sqlite, sqlite3_column_name);
+    DLOAD(sqlite, sqlite3_column_int);
+    DLOAD(sqlite, sqlite3_column_text);
+    DLOAD(sqlite, sqlite3_column_bytes);
+
+    *(void **) &sqlite3_prepare_v3 = dlsym(sqlite, "sqlite3_prepare_v3");
 
     dl_init = 1;
     return true;
@@ -117,6 +173,7 @@ db_settings::db_settings() {
     data[SU_MNT_NS] = NAMESPACE_MODE_REQUESTER;
     data[DENYLIST_CONFIG] = false;
     data[ZYGISK_CONFIG] = MagiskD::get()->is_emulator();
+    data[MOUNT_MODE] = MOUNT_MODE_MAGIC;
 }
 
 int db_settings::get_idx(string_view key) const {
@@ -144,14 +201,22 @@ static char *open_and_init_db(sqlite3 *&db) {
             SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE | SQLITE_OPEN_FULLMUTEX, nullptr);
     if (ret)
         return strdup(sqlite3_errmsg(db));
+    char *err = nullptr;
+
+    // With WAL, a transaction only needs to sync once on commit, and NORMAL
+    // synchronous mode is still durable against application crashes.
+    sqlite3_exec(db, "PRAGMA journal_mode=WAL; PRAGMA synchronous=NORMAL",
+            nullptr, nullptr, &err);
+    err_ret(err);
+
     int ver = 0;
     bool upgrade = false;
-    char *err = nullptr;
     sqlite3_exec(db, "PRAGMA user_version", ver_cb, &ver, &err);
     err_ret(err);
     if (ver > DB_VERSION) {
         // Don't support downgrading database
         sqlite3_close(db);
+        db = nullptr;
         return strdup("Downgrading database is not supported");
     }
 
@@ -279,119 +344,206 @@ static char *open_and_init_db(sqlite3 *&db) {
     return nullptr;
 }
 
-char *db_exec(const char *sql) {
-    char *err = nullptr;
-    if (mDB == nullptr) {
+static bool db_err(char *e) {
+    if (e) {
+        LOGE("sqlite3_exec: %s\n", e);
+        sqlite3_free(e);
+        return true;
+    }
+    return false;
+}
+
+// Should be called with db_lock held
+static bool ensure_db() {
+    if (mDB)
+        return true;
+    if (!dload_sqlite())
+        return false;
+    char *err = open_and_init_db(mDB);
+    if (db_err(err)) {
+        // Open fails, remove and reconstruct
+        if (mDB) {
+            sqlite3_close(mDB);
+            mDB = nullptr;
+        }
+        unlink(MAGISKDB);
+        unlink(MAGISKDB "-wal");
+        unlink(MAGISKDB "-shm");
         err = open_and_init_db(mDB);
-        db_err_cmd(err,
-            // Open fails, remove and reconstruct
-            unlink(MAGISKDB);
-            err = open_and_init_db(mDB);
-            err_ret(err);
-        );
+        if (db_err(err)) {
+            mDB = nullptr;
+            return false;
+        }
+    }
+    return true;
+}
+
+static int prepare(const char *sql, bool persistent, sqlite3_stmt **stmt, const char **tail) {
+    if (sqlite3_prepare_v3) {
+        return sqlite3_prepare_v3(
+                mDB, sql, -1, persistent ? SQLITE_PREPARE_PERSISTENT : 0, stmt, tail);
     }
-    if (mDB) {
-        sqlite3_exec(mDB, sql, nullptr, nullptr, &err);
-        return err;
+    return sqlite3_prepare_v2(mDB, sql, -1, stmt, tail);
+}
+
+// Step through all rows of the statement, then reset it for the next use
+static bool step_stmt(sqlite3_stmt *stmt, const db_row_cb &fn) {
+    int ret;
+    while ((ret = sqlite3_step(stmt)) == SQLITE_ROW) {
+        if (fn && !fn(db_values(stmt)))
+            break;
     }
-    return nullptr;
+    bool ok = ret == SQLITE_ROW || ret == SQLITE_DONE;
+    if (!ok)
+        LOGE("sqlite3_step: %s\n", sqlite3_errmsg(mDB));
+    sqlite3_reset(stmt);
+    return ok;
 }
 
-static int sqlite_db_row_callback(void *cb, int col_num, char **data, char **col_name) {
-    auto &func = *static_cast<const db_row_cb*>(cb);
-    db_row row;
-    for (int i = 0; i < col_num; ++i)
-        row[col_name[i]] = data[i];
-    return func(row) ? 0 : 1;
+int db_values::columns() const {
+    return sqlite3_column_count(stmt);
 }
 
-char *db_exec(const char *sql, const db_row_cb &fn) {
-    char *err = nullptr;
-    if (mDB == nullptr) {
-        err = open_and_init_db(mDB);
-        db_err_cmd(err,
-            // Open fails, remove and reconstruct
-            unlink(MAGISKDB);
-            err = open_and_init_db(mDB);
-            err_ret(err);
-        );
+const char *db_values::name(int idx) const {
+    return sqlite3_column_name(stmt, idx);
+}
+
+int db_values::get_int(int idx) const {
+    return sqlite3_column_int(stmt, idx);
+}
+
+string_view db_values::get_text(int idx) const {
+    auto text = reinterpret_cast<const char *>(sqlite3_column_text(stmt, idx));
+    // NULL columns are reported as empty strings
+    if (text == nullptr)
+        return "";
+    return { text, static_cast<size_t>(sqlite3_column_bytes(stmt, idx)) };
+}
+
+bool db_exec(const char *sql, db_args args, const db_row_cb &fn) {
+    mutex_guard lock(db_lock);
+    if (!ensure_db())
+        return false;
+
+    sqlite3_stmt *stmt;
+    if (auto it = stmt_cache.find(sql); it != stmt_cache.end()) {
+        stmt = it->second;
+    } else {
+        DBLOGV("prepare [%s]\n", sql);
+        if (prepare(sql, true, &stmt, nullptr) != SQLITE_OK || stmt == nullptr) {
+            LOGE("sqlite3_prepare: %s\n", sqlite3_errmsg(mDB));
+            return false;
+        }
+        stmt_cache.emplace(sql, stmt);
+    }
+
+    if (sqlite3_bind_parameter_count(stmt) != static_cast<int>(args.size())) {
+        LOGE("magiskdb: argument count mismatch for [%s]\n", sql);
+        return false;
     }
-    if (mDB) {
-        sqlite3_exec(mDB, sql, sqlite_db_row_callback, (void *) &fn, &err);
-        return err;
+    int idx = 0;
+    for (const auto &arg : args) {
+        ++idx;
+        int ret;
+        if (arg.type == db_arg::INT) {
+            ret = sqlite3_bind_int64(stmt, idx, arg.int_val);
+        } else {
+            // Bound values only need to live until the statement is reset
+            ret = sqlite3_bind_text(stmt, idx, arg.str_val.data(),
+                    static_cast<int>(arg.str_val.size()), SQLITE_STATIC);
+        }
+        if (ret != SQLITE_OK) {
+            LOGE("sqlite3_bind: %s\n", sqlite3_errmsg(mDB));
+            sqlite3_reset(stmt);
+            return false;
+        }
     }
-    return nullptr;
+
+    return step_stmt(stmt, fn);
+}
+
+bool db_transaction(const function<bool()> &fn) {
+    mutex_guard lock(db_lock);
+    if (!ensure_db())
+        return false;
+
+    if (!db_exec("BEGIN IMMEDIATE"))
+        return false;
+    if (fn() && db_exec("COMMIT"))
+        return true;
+    db_exec("ROLLBACK");
+    return false;
 }
 
 int get_db_settings(db_settings &cfg, int key) {
-    char *err = nullptr;
-    auto settings_cb = [&](db_row &row) -> bool {
-        cfg[row["key"]] = parse_int(row["value"]);
-        DBLOGV("query %s=[%s]\n", row["key"].data(), row["value"].data());
+    auto settings_cb = [&](const db_values &v) -> bool {
+        cfg[v.get_text(0)] = v.get_int(1);
+        DBLOGV("query %s=[%d]\n", v.get_text(0).data(), v.get_int(1));
         return true;
     };
+    bool ok;
     if (key >= 0) {
-        char query[128];
-        ssprintf(query, sizeof(query), "SELECT * FROM settings WHERE key='%s'", DB_SETTING_KEYS[key]);
-        err = db_exec(query, settings_cb);
+        ok = db_exec("SELECT key, value FROM settings WHERE key=?",
+                     { DB_SETTING_KEYS[key] }, settings_cb);
     } else {
-        err = db_exec("SELECT * FROM settings", settings_cb);
+        ok = db_exec("SELECT key, value FROM settings", {}, settings_cb);
     }
-    db_err_cmd(err, return 1);
-    return 0;
+    return ok ? 0 : 1;
 }
 
 int get_db_strings(db_strings &str, int key) {
-    char *err = nullptr;
-    auto string_cb = [&](db_row &row) -> bool {
-        str[row["key"]] = row["value"];
-        DBLOGV("query %s=[%s]\n", row["key"].data(), row["value"].data());
+    auto string_cb = [&](const db_values &v) -> bool {
+        str[v.get_text(0)] = v.get_text(1);
+        DBLOGV("query %s=[%s]\n", v.get_text(0).data(), v.get_text(1).data());
         return true;
     };
+    bool ok;
     if (key >= 0) {
-        char query[128];
-        ssprintf(query, sizeof(query), "SELECT * FROM strings WHERE key='%s'", DB_STRING_KEYS[key]);
-        err = db_exec(query, string_cb);
+        ok = db_exec("SELECT key, value FROM strings WHERE key=?",
+                     { DB_STRING_KEYS[key] }, string_cb);
     } else {
-        err = db_exec("SELECT * FROM strings", string_cb);
+        ok = db_exec("SELECT key, value FROM strings", {}, string_cb);
     }
-    db_err_cmd(err, return 1);
-    return 0;
+    return ok ? 0 : 1;
 }
 
 void rm_db_strings(int key) {
-    char *err;
-    char query[128];
-    ssprintf(query, sizeof(query), "DELETE FROM strings WHERE key == '%s'", DB_STRING_KEYS[key]);
-    err = db_exec(query);
-    db_err_cmd(err, return);
+    db_exec("DELETE FROM strings WHERE key=?", { DB_STRING_KEYS[key] });
 }
 
 void exec_sql(int client) {
     run_finally f([=]{ close(client); });
     string sql = read_string(client);
-    char *err = db_exec(sql.data(), [client](db_row &row) -> bool {
-        string out;
-        bool first = true;
-        for (auto it : row) {
-            if (first) first = false;
-            else out += '|';
-            out += it.first;
-            out += '=';
-            out += it.second;
-        }
-        write_string(client, out);
-        return true;
-    });
-    write_int(client, 0);
-    db_err_cmd(err, return; );
-}
 
-bool db_err(char *e) {
-    if (e) {
-        LOGE("sqlite3_exec: %s\n", e);
-        sqlite3_free(e);
-        return true;
+    mutex_guard lock(db_lock);
+    if (ensure_db()) {
+        auto row_cb = [client](const db_values &v) -> bool {
+            string out;
+            for (int i = 0; i < v.columns(); ++i) {
+                if (i != 0) out += '|';
+                out += v.name(i);
+                out += '=';
+                out += v.get_text(i);
+            }
+            write_string(client, out);
+            return true;
+        };
+        // Arbitrary SQL may contain multiple statements, and is never cached
+        const char *tail = sql.data();
+        while (*tail) {
+            sqlite3_stmt *stmt = nullptr;
+            if (prepare(tail, false, &stmt, &tail) != SQLITE_OK) {
+                LOGE("sqlite3_prepare: %s\n", sqlite3_errmsg(mDB));
+                break;
+            }
+            // Comments or trailing whitespaces
+            if (stmt == nullptr)
+                break;
+            bool ok = step_stmt(stmt, row_cb);
+            sqlite3_finalize(stmt);
+            if (!ok)
+                break;
+        }
     }
-    return false;
+    write_int(client, 0);
 }
@@ -20,6 +20,10 @@ Actions:
    add PKG [PROC]  Add a new target to the denylist
    rm PKG [PROC]   Remove target(s) from the denylist
    ls              Print the current denylist
+   add-batch       Add targets read from stdin in one transaction,
+                   one PKG[|PROC] per line (same format as ls)
+   rm-batch        Remove targets read from stdin in one transaction,
+                   one PKG[|PROC] per line (same format as ls)
    exec CMDs...    Execute commands in isolated mount
                    namespace and do all unmounts
 
@@ -49,6 +53,12 @@ void denylist_handler(int client, const sock_cred *cred) {
     case DenyRequest::REMOVE:
         res = rm_list(client);
         break;
+    case DenyRequest::ADD_BATCH:
+        res = add_list_batch(client);
+        break;
+    case DenyRequest::REMOVE_BATCH:
+        res = rm_list_batch(client);
+        break;
     case DenyRequest::LIST:
         ls_list(client);
         return;
@@ -81,6 +91,10 @@ int denylist_cli(int argc, char **argv) {
         req = DenyRequest::LIST;
     else if (argv[1] == "status"sv)
         req = DenyRequest::STATUS;
+    else if (argv[1] == "add-batch"sv)
+        req = DenyRequest::ADD_BATCH;
+    else if (argv[1] == "rm-batch"sv)
+        req = DenyRequest::REMOVE_BATCH;
     else if (argv[1] == "exec"sv && argc > 2) {
         xunshare(CLONE_NEWNS);
         xmount(nullptr, "/", nullptr, MS_PRIVATE | MS_REC, nullptr);
@@ -97,6 +111,23 @@ int denylist_cli(int argc, char **argv) {
     if (req == DenyRequest::ADD || req == DenyRequest::REMOVE) {
         write_string(fd, argv[2]);
         write_string(fd, argv[3] ? argv[3] : "");
+    } else if (req == DenyRequest::ADD_BATCH || req == DenyRequest::REMOVE_BATCH) {
+        vector<pair<string, string>> items;
+        file_readline(true, stdin, [&](string_view line) -> bool {
+            if (line.empty())
+                return true;
+            auto pos = line.find('|');
+            if (pos == string_view::npos)
+                items.emplace_back(line, "");
+            else
+                items.emplace_back(line.substr(0, pos), line.substr(pos + 1));
+            return true;
+        });
+        write_int(fd, items.size());
+        for (const auto &[pkg, proc] : items) {
+            write_string(fd, pkg);
+            write_string(fd, proc);
+        }
     }
 
     // Get response
@@ -18,6 +18,8 @@ enum : int {
     REMOVE,
     LIST,
     STATUS,
+    ADD_BATCH,
+    REMOVE_BATCH,
 
     END
 };
@@ -43,4 +45,6 @@ int enable_deny();
 int disable_deny();
 int add_list(int client);
 int rm_list(int client);
+int add_list_batch(int client);
+int rm_list_batch(int client);
 void ls_list(int client);
@@ -1,5 +1,5 @@
-#include <set>
 #include <sys/mount.h>
+#include <fcntl.h>
 
 #include <consts.hpp>
 #include <base.hpp>
@@ -14,29 +14,105 @@ static void lazy_unmount(const char* mountpoint) {
         LOGD("denylist: Unmounted (%s)\n", mountpoint);
 }
 
-void revert_unmount() {
-    set<string> targets;
+// This runs in every app on the denylist, so instead of parse_mount_info, tokenize
+// each line in place within a single fixed size buffer and only look at the fields
+// required to decide whether a mount has to be reverted.
+template<class F>
+static void scan_mount_info(const char *pid, const F &fn) {
+    char buf[16384];
+    ssprintf(buf, sizeof(buf), "/proc/%s/mountinfo", pid);
+    int fd = open(buf, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return;
+
+    size_t len = 0;
+    for (;;) {
+        ssize_t r = read(fd, buf + len, sizeof(buf) - len);
+        if (r <= 0)
+            break;
+        len += r;
+        char *begin = buf;
+        char *end = buf + len;
+        for (char *eol; (eol = static_cast<char *>(memchr(begin, '\n', end - begin)));) {
+            // Fields: id parent maj:min root target vfs_option [optional...] - type source ...
+            string_view line(begin, eol - begin);
+            string_view fields[9];
+            int n = 0;
+            bool separator = false;
+            for (size_t pos = 0; pos < line.size() && n < 9;) {
+                size_t next = line.find(' ', pos);
+                if (next == string_view::npos)
+                    next = line.size();
+                auto field = line.substr(pos, next - pos);
+                pos = next + 1;
+                if (n < 6) {
+                    fields[n++] = field;
+                } else if (!separator) {
+                    // Skip optional fields
+                    if (field == "-") {
+                        separator = true;
+                        n = 7;
+                    }
+                } else {
+                    fields[n++] = field;
+                }
+            }
+            if (n == 9) {
+                // root, target, source
+                fn(fields[3], fields[4], fields[8]);
+            }
+            begin = eol + 1;
+        }
+        // Move the incomplete line to the front of the buffer
+        len = end - begin;
+        if (len == sizeof(buf)) {
+            // Line too long to handle, should never happen
+            len = 0;
+        } else {
+            memmove(buf, begin, len);
+        }
+    }
+    close(fd);
+}
+
+string get_unmount_targets(const char *pid) {
+    vector<string> targets;
 
     // Unmount dummy skeletons and MAGISKTMP
     // since mirror nodes are always mounted under skeleton, we don't have to specifically unmount
-    for (auto &info: parse_mount_info("self")) {
-        if (info.source == "magisk" || info.source == "worker" || // magisktmp tmpfs
-            info.root.starts_with("/adb/modules")) { // bind mount from data partition
-            targets.insert(info.target);
+    scan_mount_info(pid, [&](string_view root, string_view target, string_view source) {
+        if (source == "magisk" || source == "worker" || // magisktmp tmpfs
+            root.starts_with("/adb/modules")) { // bind mount from data partition
+            targets.emplace_back(target);
         }
-    }
+    });
 
-    if (targets.empty()) return;
+    sort(targets.begin(), targets.end());
+    targets.erase(unique(targets.begin(), targets.end()), targets.end());
 
-    auto last_target = *targets.cbegin() + '/';
-    for (auto iter = next(targets.cbegin()); iter != targets.cend();) {
-        if (iter->starts_with(last_target)) {
-            iter = targets.erase(iter);
-        } else {
-            last_target = *iter++ + '/';
+    // Skip targets under another target, and join with null terminators
+    string result;
+    string_view last_target;
+    for (const auto &target : targets) {
+        if (!last_target.empty() && target.starts_with(last_target) &&
+            target.size() > last_target.size() && target[last_target.size()] == '/') {
+            continue;
         }
+        last_target = target;
+        result += target;
+        result += '\0';
     }
+    return result;
+}
 
-    for (auto &s : targets)
-        lazy_unmount(s.data());
+void revert_unmount(string_view targets) {
+    for (size_t pos = 0; pos < targets.size();) {
+        const char *target = targets.data() + pos;
+        lazy_unmount(target);
+        pos += strlen(target) + 1;
+    }
+}
+
+void revert_unmount() {
+    revert_unmount(get_unmount_targets("self"));
 }
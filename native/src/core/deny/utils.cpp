@@ -4,6 +4,7 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <dirent.h>
+#include <sched.h>
 #include <set>
 
 #include <consts.hpp>
@@ -31,6 +32,72 @@ static unique_ptr<map<int, set<string_view>>> app_id_to_pkgs_;
 // Locks the data structures above
 static pthread_mutex_t data_lock = PTHREAD_MUTEX_INITIALIZER;
 
+// Immutable lookup table derived from the data structures above.
+// is_deny_target runs on every app fork, so readers never take data_lock;
+// writers build a new snapshot and publish it with a single pointer swap.
+struct deny_snapshot {
+    // App IDs that have at least one package on the denylist
+    dynamic_bitset app_ids;
+    // (app ID, process name), sorted for binary search
+    vector<pair<int, string>> procs;
+    // Process name prefixes of isolated services
+    vector<string> isolated;
+
+    bool is_target(int app_id, string_view process) const;
+};
+
+static atomic<deny_snapshot *> snapshot = nullptr;
+// Number of readers that may still be accessing a snapshot
+static atomic<int> snapshot_readers = 0;
+
+bool deny_snapshot::is_target(int app_id, string_view process) const {
+    if (app_id >= 90000) {
+        for (const auto &s : isolated) {
+            if (str_starts(process, s))
+                return true;
+        }
+        return false;
+    }
+    if (!app_ids[app_id])
+        return false;
+    auto it = lower_bound(procs.begin(), procs.end(), make_pair(app_id, process),
+        [](const pair<int, string> &a, const pair<int, string_view> &b) {
+            return a.first != b.first ? a.first < b.first : string_view(a.second) < b.second;
+        });
+    return it != procs.end() && it->first == app_id && it->second == process;
+}
+
+static void publish_snapshot(deny_snapshot *snap) {
+    deny_snapshot *old = snapshot.exchange(snap);
+    // Wait until no reader can possibly hold the old snapshot
+    while (snapshot_readers.load() != 0)
+        sched_yield();
+    delete old;
+}
+
+// Should be called with data_lock held after every change to the data structures
+static void update_snapshot() {
+    if (!pkg_to_procs_ || !app_id_to_pkgs_) {
+        publish_snapshot(nullptr);
+        return;
+    }
+    auto snap = new deny_snapshot();
+    if (auto it = pkg_to_procs.find(ISOLATED_MAGIC); it != pkg_to_procs.end()) {
+        snap->isolated.assign(it->second.begin(), it->second.end());
+    }
+    for (const auto &[app_id, pkgs] : app_id_to_pkgs) {
+        snap->app_ids[app_id] = true;
+        for (const auto &pkg : pkgs) {
+            for (const auto &proc : pkg_to_procs.find(pkg)->second) {
+                snap->procs.emplace_back(app_id, proc);
+            }
+        }
+    }
+    sort(snap->procs.begin(), snap->procs.end());
+    snap->procs.erase(unique(snap->procs.begin(), snap->procs.end()), snap->procs.end());
+    publish_snapshot(snap);
+}
+
 atomic<bool> denylist_enforced = false;
 
 #define do_kill (zygisk_enabled && denylist_enforced)
@@ -40,109 +107,130 @@ static void rescan_apps() {
 
     app_id_to_pkgs.clear();
 
-    auto data_dir = xopen_dir(APP_DATA_DIR);
-    if (!data_dir)
-        return;
-    dirent *entry;
-    while ((entry = xreaddir(data_dir.get()))) {
-        // For each user
-        int dfd = xopenat(dirfd(data_dir.get()), entry->d_name, O_RDONLY);
-        if (auto dir = xopen_dir(dfd)) {
-            while ((entry = xreaddir(dir.get()))) {
-                struct stat st{};
-                // For each package
-                if (xfstatat(dfd, entry->d_name, &st, 0))
-                    continue;
-                int app_id = to_app_id(st.st_uid);
-                if (auto it = pkg_to_procs.find(entry->d_name); it != pkg_to_procs.end()) {
-                    app_id_to_pkgs[app_id].insert(it->first);
-                }
-            }
-        } else {
-            close(dfd);
+    auto index = get_pkg_index();
+    for (const auto &[pkg, procs] : pkg_to_procs) {
+        if (auto it = index->find(pkg); it != index->end()) {
+            app_id_to_pkgs[it->second].insert(pkg);
         }
     }
 }
 
 static void update_pkg_uid(const string &pkg, bool remove) {
-    auto data_dir = xopen_dir(APP_DATA_DIR);
-    if (!data_dir)
+    auto index = get_pkg_index();
+    auto it = index->find(pkg);
+    if (it == index->end())
         return;
-    dirent *entry;
-    struct stat st{};
-    char buf[PATH_MAX] = {0};
-    // For each user
-    while ((entry = xreaddir(data_dir.get()))) {
-        ssprintf(buf, sizeof(buf), "%s/%s", entry->d_name, pkg.data());
-        if (fstatat(dirfd(data_dir.get()), buf, &st, 0) == 0) {
-            int app_id = to_app_id(st.st_uid);
-            if (remove) {
-                if (auto it = app_id_to_pkgs.find(app_id); it != app_id_to_pkgs.end()) {
-                    it->second.erase(pkg);
-                    if (it->second.empty()) {
-                        app_id_to_pkgs.erase(it);
-                    }
-                }
-            } else {
-                app_id_to_pkgs[app_id].insert(pkg);
+    int app_id = it->second;
+    if (remove) {
+        if (auto pkgs = app_id_to_pkgs.find(app_id); pkgs != app_id_to_pkgs.end()) {
+            pkgs->second.erase(pkg);
+            if (pkgs->second.empty()) {
+                app_id_to_pkgs.erase(pkgs);
             }
-            break;
         }
+    } else {
+        app_id_to_pkgs[app_id].insert(pkg);
     }
 }
 
 // Leave /proc fd opened as we're going to read from it repeatedly
 static DIR *procfp;
 
-template<class F>
-static void crawl_procfs(const F &fn) {
+static inline bool str_eql(string_view a, string_view b) { return a == b; }
+
+// Snapshot of all running processes.
+// Built with a single sweep of /proc when first used, and shared across a whole
+// batch operation so that killing N targets does not crawl procfs N times.
+class proc_table {
+public:
+    struct entry {
+        int pid;
+        uid_t uid;
+        string cmdline;
+        string context;
+    };
+
+    explicit proc_table(bool with_context = false) : with_context(with_context) {}
+
+    template<bool matcher(const entry &, string_view)>
+    void kill(const char *name, bool multi) {
+        scan();
+        for (auto &p : procs) {
+            if (p.pid > 0 && matcher(p, name)) {
+                ::kill(p.pid, SIGKILL);
+                LOGD("denylist: kill PID=[%d] (%s)\n", p.pid, name);
+                // Never match a killed process again
+                p.pid = -1;
+                if (!multi)
+                    break;
+            }
+        }
+    }
+
+private:
+    void scan();
+
+    bool with_context;
+    bool scanned = false;
+    vector<entry> procs;
+};
+
+// Read with a single pread, returns the length of the first null terminated string
+static ssize_t read_proc_str(int dfd, const char *path, char *buf, size_t sz) {
+    int fd = openat(dfd, path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return -1;
+    ssize_t len = pread(fd, buf, sz - 1, 0);
+    close(fd);
+    if (len < 0)
+        return -1;
+    buf[len] = '\0';
+    return strlen(buf);
+}
+
+void proc_table::scan() {
+    if (scanned)
+        return;
+    scanned = true;
+
     rewinddir(procfp);
+    int dfd = dirfd(procfp);
+    char path[64];
+    char buf[4096];
     dirent *dp;
-    int pid;
     while ((dp = readdir(procfp))) {
-        pid = parse_int(dp->d_name);
-        if (pid > 0 && !fn(pid))
-            break;
+        int pid = parse_int(dp->d_name);
+        if (pid <= 0)
+            continue;
+        struct stat st{};
+        if (fstatat(dfd, dp->d_name, &st, 0) != 0)
+            continue;
+        entry &p = procs.emplace_back();
+        p.pid = pid;
+        p.uid = st.st_uid;
+        ssprintf(path, sizeof(path), "%d/cmdline", pid);
+        if (ssize_t len = read_proc_str(dfd, path, buf, sizeof(buf)); len > 0)
+            p.cmdline.assign(buf, len);
+        if (with_context) {
+            ssprintf(path, sizeof(path), "%d/attr/current", pid);
+            if (ssize_t len = read_proc_str(dfd, path, buf, sizeof(buf)); len > 0)
+                p.context.assign(buf, len);
+        }
     }
 }
 
-static inline bool str_eql(string_view a, string_view b) { return a == b; }
-
 template<bool str_op(string_view, string_view) = &str_eql>
-static bool proc_name_match(int pid, string_view name) {
-    char buf[4019];
-    sprintf(buf, "/proc/%d/cmdline", pid);
-    if (auto fp = open_file(buf, "re")) {
-        fgets(buf, sizeof(buf), fp.get());
-        if (str_op(buf, name)) {
-            return true;
-        }
-    }
-    return false;
+static bool proc_name_match(const proc_table::entry &p, string_view name) {
+    return str_op(p.cmdline, name);
 }
 
-static bool proc_context_match(int pid, string_view context) {
-    char buf[PATH_MAX];
-    sprintf(buf, "/proc/%d/attr/current", pid);
-    if (auto fp = open_file(buf, "re")) {
-        fgets(buf, sizeof(buf), fp.get());
-        if (str_starts(buf, context)) {
-            return true;
-        }
-    }
-    return false;
+static bool proc_context_match(const proc_table::entry &p, string_view context) {
+    return str_starts(p.context, context);
 }
 
-template<bool matcher(int, string_view) = &proc_name_match>
-static void kill_process(const char *name, bool multi = false) {
-    crawl_procfs([=](int pid) -> bool {
-        if (matcher(pid, name)) {
-            kill(pid, SIGKILL);
-            LOGD("denylist: kill PID=[%d] (%s)\n", pid, name);
-            return multi;
-        }
-        return true;
-    });
+template<bool matcher(const proc_table::entry &, string_view) = &proc_name_match>
+static void kill_process(proc_table &procs, const char *name, bool multi = false) {
+    procs.kill<matcher>(name, multi);
 }
 
 static bool validate(const char *pkg, const char *proc) {
@@ -181,7 +269,7 @@ static bool validate(const char *pkg, const char *proc) {
     return pkg_valid && proc_valid;
 }
 
-static bool add_hide_set(const char *pkg, const char *proc) {
+static bool add_hide_set(const char *pkg, const char *proc, proc_table &procs) {
     auto p = pkg_to_procs[pkg].emplace(proc);
     if (!p.second)
         return false;
@@ -190,9 +278,9 @@ static bool add_hide_set(const char *pkg, const char *proc) {
         return true;
     if (str_eql(pkg, ISOLATED_MAGIC)) {
         // Kill all matching isolated processes
-        kill_process<&proc_name_match<str_starts>>(proc, true);
+        kill_process<&proc_name_match<str_starts>>(procs, proc, true);
     } else {
-        kill_process(proc);
+        kill_process(procs, proc);
     }
     return true;
 }
@@ -200,23 +288,31 @@ static bool add_hide_set(const char *pkg, const char *proc) {
 static void clear_data() {
     pkg_to_procs_.reset(nullptr);
     app_id_to_pkgs_.reset(nullptr);
+    update_snapshot();
 }
 
-static bool ensure_data() {
+static bool ensure_data(proc_table *procs = nullptr) {
     if (pkg_to_procs_)
         return true;
 
     LOGI("denylist: initializing internal data structures\n");
 
+    proc_table local_procs;
+    if (procs == nullptr)
+        procs = &local_procs;
+
     default_new(pkg_to_procs_);
-    char *err = db_exec("SELECT * FROM denylist", [](db_row &row) -> bool {
-        add_hide_set(row["package_name"].data(), row["process"].data());
+    bool ok = db_exec("SELECT package_name, process FROM denylist", {},
+                      [=](const db_values &v) -> bool {
+        add_hide_set(v.get_text(0).data(), v.get_text(1).data(), *procs);
         return true;
     });
-    db_err_cmd(err, goto error)
+    if (!ok)
+        goto error;
 
     default_new(app_id_to_pkgs_);
     rescan_apps();
+    update_snapshot();
 
     return true;
 
@@ -236,18 +332,17 @@ static int add_list(const char *pkg, const char *proc) {
         mutex_guard lock(data_lock);
         if (!ensure_data())
             return DenyResponse::ERROR;
-        if (!add_hide_set(pkg, proc))
+        proc_table procs;
+        if (!add_hide_set(pkg, proc, procs))
             return DenyResponse::ITEM_EXIST;
         auto it = pkg_to_procs.find(pkg);
         update_pkg_uid(it->first, false);
+        update_snapshot();
     }
 
     // Add to database
-    char sql[4096];
-    ssprintf(sql, sizeof(sql),
-            "INSERT INTO denylist (package_name, process) VALUES('%s', '%s')", pkg, proc);
-    char *err = db_exec(sql);
-    db_err_cmd(err, return DenyResponse::ERROR)
+    if (!db_exec("INSERT INTO denylist (package_name, process) VALUES(?, ?)", { pkg, proc }))
+        return DenyResponse::ERROR;
     return DenyResponse::OK;
 }
 
@@ -257,43 +352,45 @@ int add_list(int client) {
     return add_list(pkg.data(), proc.data());
 }
 
+// Remove from the in-memory lists, returns false if nothing is removed
+static bool rm_hide_set(const char *pkg, const char *proc, bool update_uid) {
+    auto it = pkg_to_procs.find(pkg);
+    if (it == pkg_to_procs.end())
+        return false;
+    if (proc[0] == '\0') {
+        LOGI("denylist rm: [%s]\n", pkg);
+    } else if (it->second.erase(proc) != 0) {
+        LOGI("denylist rm: [%s/%s]\n", pkg, proc);
+        if (!it->second.empty())
+            return true;
+    } else {
+        return false;
+    }
+    if (update_uid)
+        update_pkg_uid(it->first, true);
+    pkg_to_procs.erase(it);
+    return true;
+}
+
+static bool db_rm_list(const char *pkg, const char *proc) {
+    if (proc[0] == '\0')
+        return db_exec("DELETE FROM denylist WHERE package_name=?", { pkg });
+    else
+        return db_exec("DELETE FROM denylist WHERE package_name=? AND process=?", { pkg, proc });
+}
+
 static int rm_list(const char *pkg, const char *proc) {
     {
         mutex_guard lock(data_lock);
         if (!ensure_data())
             return DenyResponse::ERROR;
-
-        bool remove = false;
-
-        auto it = pkg_to_procs.find(pkg);
-        if (it != pkg_to_procs.end()) {
-            if (proc[0] == '\0') {
-                update_pkg_uid(it->first, true);
-                pkg_to_procs.erase(it);
-                remove = true;
-                LOGI("denylist rm: [%s]\n", pkg);
-            } else if (it->second.erase(proc) != 0) {
-                remove = true;
-                LOGI("denylist rm: [%s/%s]\n", pkg, proc);
-                if (it->second.empty()) {
-                    update_pkg_uid(it->first, true);
-                    pkg_to_procs.erase(it);
-                }
-            }
-        }
-
-        if (!remove)
+        if (!rm_hide_set(pkg, proc, true))
             return DenyResponse::ITEM_NOT_EXIST;
+        update_snapshot();
     }
 
-    char sql[4096];
-    if (proc[0] == '\0')
-        ssprintf(sql, sizeof(sql), "DELETE FROM denylist WHERE package_name='%s'", pkg);
-    else
-        ssprintf(sql, sizeof(sql),
-                "DELETE FROM denylist WHERE package_name='%s' AND process='%s'", pkg, proc);
-    char *err = db_exec(sql);
-    db_err_cmd(err, return DenyResponse::ERROR)
+    if (!db_rm_list(pkg, proc))
+        return DenyResponse::ERROR;
     return DenyResponse::OK;
 }
 
@@ -303,6 +400,87 @@ int rm_list(int client) {
     return rm_list(pkg.data(), proc.data());
 }
 
+static bool read_batch(int client, vector<pair<string, string>> &items) {
+    int cnt = read_int(client);
+    if (cnt < 0)
+        return false;
+    // Grow while reading, the count comes from the client and cannot be trusted
+    for (int i = 0; i < cnt; ++i) {
+        auto &[pkg, proc] = items.emplace_back();
+        if (!read_string(client, pkg) || !read_string(client, proc))
+            return false;
+    }
+    return true;
+}
+
+// Batch operations apply all entries within one database transaction.
+// Entries that already exist (or do not exist for removal) are skipped.
+int add_list_batch(int client) {
+    vector<pair<string, string>> items;
+    if (!read_batch(client, items))
+        return DenyResponse::ERROR;
+
+    // Reject the whole batch if any entry is invalid
+    for (auto &[pkg, proc] : items) {
+        if (proc.empty())
+            proc = pkg;
+        if (!validate(pkg.data(), proc.data()))
+            return DenyResponse::INVALID_PKG;
+    }
+
+    mutex_guard lock(data_lock);
+    proc_table procs;
+    if (!ensure_data(&procs))
+        return DenyResponse::ERROR;
+
+    bool ok = db_transaction([&]() -> bool {
+        for (const auto &[pkg, proc] : items) {
+            if (!add_hide_set(pkg.data(), proc.data(), procs))
+                continue;
+            if (!db_exec("INSERT INTO denylist (package_name, process) VALUES(?, ?)",
+                         { pkg, proc }))
+                return false;
+        }
+        return true;
+    });
+    if (!ok) {
+        // The in-memory lists no longer match the database, reload on next use
+        clear_data();
+        return DenyResponse::ERROR;
+    }
+    // Resolve app IDs of all new packages with a single scan
+    rescan_apps();
+    update_snapshot();
+    return DenyResponse::OK;
+}
+
+int rm_list_batch(int client) {
+    vector<pair<string, string>> items;
+    if (!read_batch(client, items))
+        return DenyResponse::ERROR;
+
+    mutex_guard lock(data_lock);
+    if (!ensure_data())
+        return DenyResponse::ERROR;
+
+    bool ok = db_transaction([&]() -> bool {
+        for (const auto &[pkg, proc] : items) {
+            if (!rm_hide_set(pkg.data(), proc.data(), false))
+                continue;
+            if (!db_rm_list(pkg.data(), proc.data()))
+                return false;
+        }
+        return true;
+    });
+    if (!ok) {
+        clear_data();
+        return DenyResponse::ERROR;
+    }
+    rescan_apps();
+    update_snapshot();
+    return DenyResponse::OK;
+}
+
 void ls_list(int client) {
     {
         mutex_guard lock(data_lock);
@@ -327,11 +505,8 @@ void ls_list(int client) {
 }
 
 static void update_deny_config() {
-    char sql[64];
-    sprintf(sql, "REPLACE INTO settings (key,value) VALUES('%s',%d)",
-        DB_SETTING_KEYS[DENYLIST_CONFIG], denylist_enforced.load());
-    char *err = db_exec(sql);
-    db_err(err);
+    db_exec("REPLACE INTO settings (key,value) VALUES(?,?)",
+            { DB_SETTING_KEYS[DENYLIST_CONFIG], denylist_enforced.load() });
 }
 
 int enable_deny() {
@@ -352,16 +527,18 @@ int enable_deny() {
 
         denylist_enforced = true;
 
-        if (!ensure_data()) {
+        // Read process contexts as well for killing app zygotes
+        proc_table procs(true);
+        if (!ensure_data(&procs)) {
             denylist_enforced = false;
             return DenyResponse::ERROR;
         }
 
         // On Android Q+, also kill blastula pool and all app zygotes
         if (SDK_INT >= 29 && zygisk_enabled) {
-            kill_process("usap32", true);
-            kill_process("usap64", true);
-            kill_process<&proc_context_match>("u:r:app_zygote:s0", true);
+            kill_process(procs, "usap32", true);
+            kill_process(procs, "usap64", true);
+            kill_process<&proc_context_match>(procs, "u:r:app_zygote:s0", true);
         }
     }
 
@@ -388,30 +565,20 @@ void initialize_denylist() {
 }
 
 bool is_deny_target(int uid, string_view process) {
-    mutex_guard lock(data_lock);
-    if (!ensure_data())
-        return false;
-
-    if (!skip_pkg_rescan.test_and_set())
-        rescan_apps();
-
-    int app_id = to_app_id(uid);
-    if (app_id >= 90000) {
-        if (auto it = pkg_to_procs.find(ISOLATED_MAGIC); it != pkg_to_procs.end()) {
-            for (const auto &s : it->second) {
-                if (str_starts(process, s))
-                    return true;
-            }
-        }
-        return false;
-    } else {
-        auto it = app_id_to_pkgs.find(app_id);
-        if (it == app_id_to_pkgs.end())
+    bool rescan = !skip_pkg_rescan.test_and_set();
+    if (rescan || snapshot.load() == nullptr) {
+        mutex_guard lock(data_lock);
+        if (!ensure_data())
             return false;
-        for (const auto &pkg : it->second) {
-            if (pkg_to_procs.find(pkg)->second.count(process))
-                return true;
+        if (rescan) {
+            rescan_apps();
+            update_snapshot();
         }
     }
-    return false;
+
+    snapshot_readers.fetch_add(1);
+    deny_snapshot *snap = snapshot.load();
+    bool target = snap && snap->is_target(to_app_id(uid), process);
+    snapshot_readers.fetch_sub(1);
+    return target;
 }
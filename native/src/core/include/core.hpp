@@ -3,6 +3,8 @@
 #include <pthread.h>
 #include <poll.h>
 #include <string>
+#include <map>
+#include <memory>
 #include <limits>
 #include <atomic>
 #include <functional>
@@ -30,14 +32,30 @@ enum class RespondCode : int {
 
 struct module_info {
     std::string name;
+    // Zygisk libraries, closed after being packed into the module bundles
     int z32 = -1;
 #if defined(__LP64__)
     int z64 = -1;
 #endif
 };
 
+// All zygisk module libraries of the same ABI are packed into a single sealed memfd.
+// The file starts with the number of modules, followed by the offset and size of the
+// library of each module in the same order as module_list. The libraries are aligned
+// to be loaded with ANDROID_DLEXT_USE_LIBRARY_FD_OFFSET. Size 0 means no library.
+#define MODULE_BUNDLE_ALIGN 0x4000
+struct module_bundle_entry {
+    uint32_t offset;
+    uint32_t size;
+};
+
 extern bool zygisk_enabled;
+extern int mount_mode;
 extern std::vector<module_info> *module_list;
+extern int module_bundle32;
+#if defined(__LP64__)
+extern int module_bundle64;
+#endif
 extern std::string native_bridge;
 
 void reset_zygisk(bool restore);
@@ -62,8 +80,11 @@ void su_daemon_handler(int client, const sock_cred *cred);
 void zygisk_handler(int client, const sock_cred *cred);
 
 // Package
+// Package name -> app ID, of packages installed in any user
+using pkg_index = std::map<std::string, int, StringCmp>;
 void preserve_stub_apk();
 void check_pkg_refresh();
+std::shared_ptr<const pkg_index> get_pkg_index();
 std::vector<bool> get_app_no_list();
 // Call check_pkg_refresh() before calling get_manager(...)
 // to make sure the package state is invalidated!
@@ -75,6 +96,7 @@ void handle_modules();
 void load_modules();
 void disable_modules();
 void remove_modules();
+void invalidate_mount_plan();
 void exec_module_scripts(const char *stage);
 
 // Scripting
@@ -92,4 +114,7 @@ extern std::atomic<bool> denylist_enforced;
 int denylist_cli(int argc, char **argv);
 void initialize_denylist();
 bool is_deny_target(int uid, std::string_view process);
+// Returns all mount points to revert in the mount namespace of pid, each null terminated
+std::string get_unmount_targets(const char *pid);
+void revert_unmount(std::string_view targets);
 void revert_unmount();
@@ -5,6 +5,8 @@
 #include <string>
 #include <string_view>
 #include <functional>
+#include <initializer_list>
+#include <type_traits>
 
 template <class T, size_t N>
 class db_dict {
@@ -39,7 +41,8 @@ constexpr const char *DB_SETTING_KEYS[] = {
     "multiuser_mode",
     "mnt_ns",
     "denylist",
-    "zygisk"
+    "zygisk",
+    "mount_mode"
 };
 
 // Settings key indices
@@ -48,7 +51,8 @@ enum {
     SU_MULTIUSER_MODE,
     SU_MNT_NS,
     DENYLIST_CONFIG,
-    ZYGISK_CONFIG
+    ZYGISK_CONFIG,
+    MOUNT_MODE
 };
 
 // Values for root_access
@@ -73,6 +77,12 @@ enum {
     NAMESPACE_MODE_ISOLATE
 };
 
+// Values for mount_mode
+enum {
+    MOUNT_MODE_MAGIC = 0,
+    MOUNT_MODE_OVERLAY
+};
+
 class db_settings : public db_dict<int, std::size(DB_SETTING_KEYS)> {
 public:
     db_settings();
@@ -120,15 +130,50 @@ struct su_access {
  * Public Functions *
  ********************/
 
-using db_row = std::map<std::string_view, std::string_view>;
-using db_row_cb = std::function<bool(db_row&)>;
+struct sqlite3_stmt;
+
+// A value bound to a `?` placeholder of a prepared statement
+struct db_arg {
+    enum { INT, TEXT } type;
+    union {
+        int64_t int_val;
+        std::string_view str_val;
+    };
+
+    template<typename T> requires(std::is_integral_v<T>)
+    db_arg(T v) : type(INT), int_val(v) {}
+    db_arg(std::string_view s) : type(TEXT), str_val(s) {}
+    db_arg(const char *s) : db_arg(std::string_view(s)) {}
+};
+
+using db_args = std::initializer_list<db_arg>;
+
+// Column accessors of the current result row, only valid within the row callback.
+// Text values are always null terminated.
+class db_values {
+public:
+    explicit db_values(sqlite3_stmt *stmt) : stmt(stmt) {}
+    int columns() const;
+    const char *name(int idx) const;
+    int get_int(int idx) const;
+    std::string_view get_text(int idx) const;
+private:
+    sqlite3_stmt *stmt;
+};
+
+// Return false to stop stepping through the result rows
+using db_row_cb = std::function<bool(const db_values&)>;
 
 int get_db_settings(db_settings &cfg, int key = -1);
 int get_db_strings(db_strings &str, int key = -1);
 void rm_db_strings(int key);
 void exec_sql(int client);
-char *db_exec(const char *sql);
-char *db_exec(const char *sql, const db_row_cb &fn);
-bool db_err(char *e);
 
-#define db_err_cmd(e, cmd) if (db_err(e)) { cmd; }
+// Run a single SQL statement with `args` bound to its `?` placeholders in order.
+// Statements are prepared once and cached, so `sql` has to be a fixed query string.
+// The callback must not issue other queries. Returns false on error.
+bool db_exec(const char *sql, db_args args = {}, const db_row_cb &fn = {});
+
+// Run all queries issued by `fn` within a single transaction.
+// Everything is rolled back if `fn` returns false or the commit fails.
+bool db_transaction(const std::function<bool()> &fn);
@@ -2,6 +2,7 @@
 
 #include <string>
 #include <map>
+#include <vector>
 #include <cxx.h>
 
 struct prop_cb {
@@ -25,6 +26,8 @@ std::string get_prop(const char *name, bool persist = false);
 int delete_prop(const char *name, bool persist = false);
 int set_prop(const char *name, const char *value, bool skip_svc = false);
 void load_prop_file(const char *filename, bool skip_svc = false);
+// Apply all props of the files as a single batch
+void load_prop_files(const std::vector<const char *> &files, bool skip_svc = false);
 
 static inline void prop_cb_exec(prop_cb &cb, const char *name, const char *value, uint32_t serial) {
     cb.exec(name, value, serial);
@@ -36,3 +36,57 @@ bool read_vector(int fd, std::vector<T> &vec) {
     vec.resize(size);
     return xread(fd, vec.data(), size * sizeof(T)) == size * sizeof(T);
 }
+
+// Framed messages
+//
+// A message is a header (payload length + number of fds) followed by the payload.
+// The whole frame is sent with a single sendmsg, with all fds attached through SCM_RIGHTS.
+
+// Maximum size of a single frame, including the header
+#define MSG_MAX_SIZE 4096
+// Maximum number of fds attached to a single frame (SCM_MAX_FD)
+#define MSG_MAX_FDS 253
+
+class msg_writer {
+public:
+    msg_writer();
+    msg_writer(const msg_writer &) = delete;
+    msg_writer &put_int(int val);
+    msg_writer &put_string(std::string_view str);
+    // The fd is not owned, it has to stay valid until the message is sent
+    msg_writer &put_fd(int fd);
+    bool send(int sockfd);
+private:
+    void put(const void *data, size_t len);
+    alignas(int) uint8_t buf[MSG_MAX_SIZE];
+    int fds[MSG_MAX_FDS];
+    size_t len;
+    int fd_cnt;
+    bool overflow;
+};
+
+// Reuse the same reader for all messages of a connection
+class msg_reader {
+public:
+    msg_reader();
+    msg_reader(const msg_reader &) = delete;
+    // Closes all received fds that are not taken
+    ~msg_reader();
+    bool recv(int sockfd);
+    // Returns -1 when reading past the end of the message
+    int get_int();
+    // Points into the internal buffer, only valid until the next recv
+    std::string_view get_string();
+    // Transfer the ownership of the next received fd, returns -1 if there are no more
+    int take_fd();
+    // Transfer the ownership of all remaining received fds
+    void take_fds(std::vector<int> &out);
+private:
+    void close_fds();
+    alignas(int) uint8_t buf[MSG_MAX_SIZE];
+    int fds[MSG_MAX_FDS];
+    size_t len;
+    size_t pos;
+    int fd_cnt;
+    int fd_pos;
+};
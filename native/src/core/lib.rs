@@ -7,7 +7,9 @@ use daemon::{daemon_entry, find_apk_path, get_magiskd, MagiskD};
 use logging::{
     android_logging, magisk_logging, zygisk_close_logd, zygisk_get_logd, zygisk_logging,
 };
-use resetprop::{persist_delete_prop, persist_get_prop, persist_get_props, persist_set_prop};
+use resetprop::{
+    persist_delete_prop, persist_get_prop, persist_get_props, persist_set_prop, persist_set_props,
+};
 
 mod cert;
 #[path = "../include/consts.rs"]
@@ -87,6 +89,7 @@ pub mod ffi {
         unsafe fn persist_get_props(prop_cb: Pin<&mut PropCb>);
         unsafe fn persist_delete_prop(name: Utf8CStrRef) -> bool;
         unsafe fn persist_set_prop(name: Utf8CStrRef, value: Utf8CStrRef) -> bool;
+        fn persist_set_props(props: &[u8]) -> bool;
     }
 
     #[namespace = "rust"]
@@ -1,12 +1,15 @@
 #include <sys/mman.h>
 #include <sys/syscall.h>
 #include <sys/mount.h>
+#include <sys/xattr.h>
 #include <map>
 #include <utility>
+#include <atomic>
 
 #include <base.hpp>
 #include <consts.hpp>
 #include <core.hpp>
+#include <db.hpp>
 #include <selinux.hpp>
 
 #include "node.hpp"
@@ -15,31 +18,316 @@ using namespace std;
 
 #define VLOGD(tag, from, to) LOGD("%-8s: %s <- %s\n", tag, to, from)
 
-static int bind_mount(const char *reason, const char *from, const char *to) {
-    int ret = xmount(from, to, nullptr, MS_BIND | MS_REC, nullptr);
-    if (ret == 0)
-        VLOGD(reason, from, to);
-    return ret;
+/*************
+ * Mount Plan
+ *************/
+
+// All filesystem operations of magic mount are recorded as a mount plan.
+// If no modules changed, the plan is replayed on the next boot
+// without building the node tree or walking any directory.
+enum : char {
+    OP_MKDIR   = 'd',
+    OP_MKDIRS  = 'p',
+    OP_CREATE  = 'f',
+    OP_BIND    = 'b',
+    OP_RDONLY  = 'r',
+    OP_MOVE    = 'm',
+    OP_COPY    = 'c',
+    OP_ATTR    = 'a',
+    OP_SYMLINK = 's',
+    OP_LINK    = 'l',
+    OP_OPAQUE  = 'x',
+    OP_OVERLAY = 'o',
+};
+
+// The plan being recorded, a list of NUL terminated tokens
+static string *mount_plan = nullptr;
+
+// Returns false if the operation did not take effect
+static bool run_op(char op, const char *a, const char *b = "") {
+    struct stat st{};
+    bool ok;
+    switch (op) {
+    case OP_MKDIR:
+        ok = mkdir(a, 0) == 0 || errno == EEXIST;
+        break;
+    case OP_MKDIRS:
+        ok = mkdirs(a, 0) == 0;
+        break;
+    case OP_CREATE: {
+        int fd = xopen(a, O_RDONLY | O_CREAT | O_CLOEXEC, 0);
+        ok = fd >= 0;
+        if (ok) close(fd);
+        break;
+    }
+    case OP_BIND:
+        ok = xmount(a, b, nullptr, MS_BIND | MS_REC, nullptr) == 0;
+        break;
+    case OP_RDONLY:
+        ok = xmount(nullptr, a, nullptr, MS_REMOUNT | MS_BIND | MS_RDONLY, nullptr) == 0;
+        break;
+    case OP_MOVE:
+        ok = xmount(a, b, nullptr, MS_MOVE, nullptr) == 0;
+        break;
+    case OP_COPY:
+        if ((ok = lstat(a, &st) == 0))
+            cp_afc(a, b);
+        break;
+    case OP_ATTR:
+        if ((ok = lstat(a, &st) == 0))
+            clone_attr(a, b);
+        break;
+    case OP_SYMLINK:
+        ok = xsymlink(a, b) == 0;
+        break;
+    case OP_LINK:
+        if ((ok = lstat(a, &st) == 0) && link(a, b) != 0)
+            cp_afc(a, b);
+        break;
+    case OP_OPAQUE:
+        ok = lsetxattr(a, "trusted.overlay.opaque", "y", 1, 0) == 0;
+        if (!ok) PLOGE("setxattr %s", a);
+        break;
+    case OP_OVERLAY:
+        ok = xmount("magisk", b, "overlay", MS_RDONLY, a) == 0;
+        break;
+    default:
+        return false;
+    }
+    if (mount_plan && !ok) {
+        // A plan that cannot be fully applied must never be replayed, drop it
+        LOGW("* Mount plan discarded, [%c] %s failed\n", op, a);
+        mount_plan->clear();
+        mount_plan = nullptr;
+    } else if (mount_plan) {
+        mount_plan->push_back(op);
+        mount_plan->push_back('\0');
+        mount_plan->append(a).push_back('\0');
+        mount_plan->append(b).push_back('\0');
+    }
+    return ok;
+}
+
+static void bind_mount(const char *reason, const char *from, const char *to) {
+    VLOGD(reason, from, to);
+    run_op(OP_BIND, from, to);
+}
+
+// The plan is only valid for the exact same set of modules on the same system.
+// Only the top of each module is checked, anything that changes deeper inside
+// (module install, update or removal) has to drop the plan with invalidate_mount_plan().
+static string mount_plan_key(const vector<const char *> &modules, bool inject_bins) {
+    char buf[4096];
+    string key = get_prop("ro.build.fingerprint");
+    key += '\n';
+    key += get_magisk_tmp();
+    key += '\n';
+    key += zygisk_enabled ? native_bridge : "0";
+    key += inject_bins ? "\nbins\n" : "\n\n";
+    key += mount_mode == MOUNT_MODE_OVERLAY ? "overlay\n" : "magic\n";
+    for (const char *module : modules) {
+        key += module;
+        for (const char *sub : { "", "/system", "/system/vendor", "/system/product",
+                                 "/system/system_ext" }) {
+            struct stat st{};
+            ssprintf(buf, sizeof(buf), MODULEROOT "/%s%s", module, sub);
+            stat(buf, &st);
+            ssprintf(buf, sizeof(buf), ":%llu.%ld.%ld", (unsigned long long) st.st_ino,
+                     (long) st.st_mtim.tv_sec, st.st_mtim.tv_nsec);
+            key += buf;
+        }
+        key += '\n';
+    }
+    return key;
+}
+
+void invalidate_mount_plan() {
+    unlink(MOUNTPLAN);
+}
+
+// Detach everything a partial replay mounted and clear our tmpfs layers,
+// so a fresh mount starts from the same state as if nothing was replayed
+static void undo_replay(const vector<const char *> &targets) {
+    for (auto it = targets.rbegin(); it != targets.rend(); ++it)
+        umount2(*it, MNT_DETACH);
+    string tmp = get_magisk_tmp();
+    if (int fd = open((tmp + "/" WORKERDIR).data(), O_RDONLY | O_DIRECTORY | O_CLOEXEC); fd >= 0)
+        frm_rf(fd);
+    rm_rf((tmp + "/" OVERLAYDIR).data());
+    rm_rf((tmp + "/" REPLACEDIR).data());
+}
+
+static bool replay_mount_plan(const string &key) {
+    string plan;
+    if (int fd = open(MOUNTPLAN, O_RDONLY | O_CLOEXEC); fd >= 0) {
+        full_read(fd, plan);
+        close(fd);
+    }
+    if (plan.size() <= key.size() || plan.compare(0, key.size(), key) != 0 ||
+        plan[key.size()] != '\0' || plan.back() != '\0')
+        return false;
+
+    vector<const char *> tokens;
+    for (size_t pos = key.size() + 1; pos < plan.size(); pos = plan.find('\0', pos) + 1)
+        tokens.push_back(plan.data() + pos);
+    if (tokens.size() % 3 != 0)
+        return false;
+
+    // Every module file the plan uses must still be there before anything is touched
+    const string &module_mnt = node_entry::module_mnt;
+    for (int i = 0; i < tokens.size(); i += 3) {
+        const char *src = tokens[i + 1];
+        struct stat st{};
+        if (strncmp(src, module_mnt.data(), module_mnt.size()) == 0 && lstat(src, &st) != 0) {
+            LOGW("* Mount plan outdated, missing %s\n", src);
+            invalidate_mount_plan();
+            return false;
+        }
+    }
+
+    LOGI("* Replaying mount plan\n");
+    vector<const char *> targets;
+    for (int i = 0; i < tokens.size(); i += 3) {
+        char op = tokens[i][0];
+        if (op == OP_BIND || op == OP_OVERLAY)
+            VLOGD("replay", tokens[i + 1], tokens[i + 2]);
+        if (!run_op(op, tokens[i + 1], tokens[i + 2])) {
+            LOGW("* Mount plan replay failed at [%c] %s, fallback to a fresh mount\n",
+                 op, tokens[i + 1]);
+            undo_replay(targets);
+            invalidate_mount_plan();
+            return false;
+        }
+        if (op == OP_BIND || op == OP_OVERLAY || op == OP_MOVE)
+            targets.push_back(tokens[i + 2]);
+    }
+    return true;
+}
+
+static void save_mount_plan(const string &plan) {
+    constexpr const char *tmp = MOUNTPLAN ".tmp";
+    int fd = xopen(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd < 0)
+        return;
+    bool ok = xwrite(fd, plan.data(), plan.size()) == static_cast<ssize_t>(plan.size());
+    close(fd);
+    if (!ok || rename(tmp, MOUNTPLAN) != 0)
+        unlink(tmp);
+}
+
+/*************
+ * Node Arena
+ *************/
+
+#define ARENA_BLOCK_SIZE (64 * 1024)
+
+struct arena_block {
+    arena_block *next;
+    // Keep the payload 16 bytes aligned on 64-bit
+    size_t pad;
+};
+
+static pthread_mutex_t arena_lock = PTHREAD_MUTEX_INITIALIZER;
+static arena_block *arena_blocks = nullptr;
+// Bumped on reset to invalidate the current block of all threads
+static atomic_uint arena_gen = 1;
+
+// Each thread bumps its own block, the block list is only shared for bookkeeping
+static thread_local struct {
+    unsigned gen;
+    uintptr_t cur;
+    uintptr_t end;
+} arena_tls;
+
+void *node_arena::alloc(size_t sz, size_t align) {
+    auto &tls = arena_tls;
+    unsigned gen = arena_gen.load(memory_order_relaxed);
+    if (tls.gen == gen) {
+        uintptr_t p = align_to(tls.cur, align);
+        if (p + sz <= tls.end) {
+            tls.cur = p + sz;
+            return reinterpret_cast<void *>(p);
+        }
+    }
+    size_t size = std::max<size_t>(ARENA_BLOCK_SIZE, sz + align);
+    auto blk = static_cast<arena_block *>(malloc(sizeof(arena_block) + size));
+    {
+        mutex_guard g(arena_lock);
+        blk->next = arena_blocks;
+        arena_blocks = blk;
+    }
+    uintptr_t start = reinterpret_cast<uintptr_t>(blk + 1);
+    uintptr_t p = align_to(start, align);
+    tls = { gen, p + sz, start + size };
+    return reinterpret_cast<void *>(p);
+}
+
+string_view node_arena::dup(string_view str) {
+    auto p = static_cast<char *>(alloc(str.size() + 1, 1));
+    memcpy(p, str.data(), str.size());
+    p[str.size()] = '\0';
+    return { p, str.size() };
+}
+
+void node_arena::reset() {
+    mutex_guard g(arena_lock);
+    arena_gen.fetch_add(1);
+    for (auto blk = arena_blocks; blk;) {
+        auto next = blk->next;
+        free(blk);
+        blk = next;
+    }
+    arena_blocks = nullptr;
 }
 
 /*************************
  * Node Tree Construction
  *************************/
 
+void dir_node::insert(vector<node_entry *> &nodes) {
+    std::sort(nodes.begin(), nodes.end(),
+              [](node_entry *a, node_entry *b) { return a->_name < b->_name; });
+    map_type merged;
+    merged.reserve(children.size() + nodes.size());
+    auto it = children.begin();
+    for (auto node : nodes) {
+        while (it != children.end() && it->first <= node->_name)
+            merged.push_back(*it++);
+        if (!merged.empty() && merged.back().first == node->_name) {
+            // Upgrade existing node only if higher rank
+            auto &ex = merged.back();
+            if (ex.second->_node_type < node->_node_type) {
+                node->consume(ex.second);
+                ex = { node->_name, node };
+            } else {
+                delete node;
+            }
+        } else {
+            node->_parent = this;
+            merged.emplace_back(node->_name, node);
+        }
+    }
+    merged.insert(merged.end(), it, children.end());
+    children.swap(merged);
+    nodes.clear();
+}
+
 tmpfs_node::tmpfs_node(node_entry *node) : dir_node(node, this) {
     if (!skip_mirror()) {
         string mirror = mirror_path();
         if (auto dir = open_dir(mirror.data())) {
             set_exist(true);
+            vector<node_entry *> nodes;
             for (dirent *entry; (entry = xreaddir(dir.get()));) {
                 if (entry->d_type == DT_DIR) {
                     // create a dummy inter_node to upgrade later
-                    emplace<inter_node>(entry->d_name, entry->d_name);
+                    nodes.push_back(new inter_node(entry->d_name));
                 } else {
                     // Insert mirror nodes
-                    emplace<mirror_node>(entry->d_name, entry);
+                    nodes.push_back(new mirror_node(entry));
                 }
             }
+            insert(nodes);
         }
     }
 
@@ -96,6 +384,8 @@ void dir_node::collect_module_files(const char *module, int dfd) {
     if (!dir)
         return;
 
+    vector<node_entry *> nodes;
+    vector<string_view> dirs;
     for (dirent *entry; (entry = xreaddir(dir.get()));) {
         if (entry->d_name == ".replace"sv) {
             set_skip_mirror(true);
@@ -103,21 +393,92 @@ void dir_node::collect_module_files(const char *module, int dfd) {
         }
 
         if (entry->d_type == DT_DIR) {
-            inter_node *node;
-            if (auto it = children.find(entry->d_name); it == children.end()) {
-                node = emplace<inter_node>(entry->d_name, entry->d_name);
-            } else {
-                node = dyn_cast<inter_node>(it->second);
-            }
-            if (node) {
-                node->collect_module_files(module, dirfd(dir.get()));
-            }
+            auto node = new inter_node(entry->d_name);
+            dirs.push_back(node->name());
+            nodes.push_back(node);
         } else {
-            emplace<module_node>(entry->d_name, module, entry);
+            nodes.push_back(new module_node(module, entry));
+        }
+    }
+    insert(nodes);
+
+    // Names live in the arena, so they stay valid even if the node got rejected
+    for (auto name : dirs) {
+        if (auto node = dyn_cast<inter_node>(iterator_to_node(find(name)))) {
+            node->collect_module_files(module, dirfd(dir.get()));
         }
     }
 }
 
+void dir_node::merge(dir_node *other) {
+    if (other->skip_mirror())
+        set_skip_mirror(true);
+    // Both children vectors are sorted, walk them side by side
+    map_type merged;
+    merged.reserve(children.size() + other->children.size());
+    auto it = children.begin();
+    for (auto &pair : other->children) {
+        node_entry *node = pair.second;
+        while (it != children.end() && it->first < pair.first)
+            merged.push_back(*it++);
+        if (it == children.end() || it->first != pair.first) {
+            node->_parent = this;
+            merged.push_back(pair);
+            continue;
+        }
+        auto &ex = merged.emplace_back(*it++);
+        if (auto dn = dyn_cast<inter_node>(node)) {
+            // Files in the existing tree take precedence over directories
+            if (auto ed = dyn_cast<inter_node>(ex.second))
+                ed->merge(dn);
+            delete node;
+        } else if (ex.second->_node_type < node->_node_type) {
+            node->consume(ex.second);
+            ex = { node->_name, node };
+        } else {
+            delete node;
+        }
+    }
+    merged.insert(merged.end(), it, children.end());
+    children.swap(merged);
+    other->children.clear();
+}
+
+// Collect files of all modules in parallel, then merge them in order
+static void collect_modules_files(root_node *system, const vector<const char *> &modules) {
+    vector<inter_node *> trees(modules.size());
+    atomic_size_t next = 0;
+    long workers = std::min<long>(modules.size(), sysconf(_SC_NPROCESSORS_ONLN));
+    pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+    pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+    long running = workers;
+    for (long i = 0; i < workers; ++i) {
+        exec_task([&] {
+            char buf[4096];
+            for (size_t n; (n = next.fetch_add(1)) < modules.size();) {
+                ssprintf(buf, sizeof(buf), "%s/" MODULEMNT "/%s", get_magisk_tmp(), modules[n]);
+                auto tree = new inter_node("system");
+                int fd = xopen(buf, O_RDONLY | O_CLOEXEC);
+                tree->collect_module_files(modules[n], fd);
+                close(fd);
+                trees[n] = tree;
+            }
+            mutex_guard g(lock);
+            if (--running == 0)
+                pthread_cond_signal(&cond);
+        });
+    }
+    {
+        mutex_guard g(lock);
+        while (running > 0)
+            pthread_cond_wait(&cond, &lock);
+    }
+    for (auto tree : trees) {
+        system->merge(tree);
+        delete tree;
+    }
+}
+
 /************************
  * Mount Implementations
  ************************/
@@ -126,17 +487,17 @@ void node_entry::create_and_mount(const char *reason, const string &src, bool ro
     const string dest = isa<tmpfs_node>(parent()) ? worker_path() : node_path();
     if (is_lnk()) {
         VLOGD("cp_link", src.data(), dest.data());
-        cp_afc(src.data(), dest.data());
+        run_op(OP_COPY, src.data(), dest.data());
     } else {
         if (is_dir())
-            xmkdir(dest.data(), 0);
+            run_op(OP_MKDIR, dest.data());
         else if (is_reg())
-            close(xopen(dest.data(), O_RDONLY | O_CREAT | O_CLOEXEC, 0));
+            run_op(OP_CREATE, dest.data());
         else
             return;
         bind_mount(reason, src.data(), dest.data());
         if (ro) {
-            xmount(nullptr, dest.data(), nullptr, MS_REMOUNT | MS_BIND | MS_RDONLY, nullptr);
+            run_op(OP_RDONLY, dest.data());
         }
     }
 }
@@ -146,11 +507,11 @@ void mirror_node::mount() {
 }
 
 void module_node::mount() {
-    std::string path = module + (parent()->root()->prefix + node_path());
+    string path = module_path();
     string mnt_src = module_mnt + path;
     {
         string src = MODULEROOT "/" + path;
-        if (exist()) clone_attr(mirror_path().data(), src.data());
+        if (exist()) run_op(OP_ATTR, mirror_path().data(), src.data());
         // special case for /system/etc/hosts to ensure it is writable
         if (node_path() == "/system/etc/hosts") mnt_src = std::move(src);
     }
@@ -167,17 +528,17 @@ void tmpfs_node::mount() {
     if (!isa<tmpfs_node>(parent())) {
         const string &dest = node_path();
         auto worker_dir = worker_path();
-        mkdirs(worker_dir.data(), 0);
+        run_op(OP_MKDIRS, worker_dir.data());
         bind_mount("tmpfs", worker_dir.data(), worker_dir.data());
-        clone_attr(src_path ?: parent()->node_path().data(), worker_dir.data());
+        run_op(OP_ATTR, src_path ?: parent()->node_path().data(), worker_dir.data());
         dir_node::mount();
         VLOGD(skip_mirror() ? "replace" : "move", worker_dir.data(), dest.data());
-        xmount(worker_dir.data(), dest.data(), nullptr, MS_MOVE, nullptr);
+        run_op(OP_MOVE, worker_dir.data(), dest.data());
     } else {
         const string dest = worker_path();
         // We don't need another layer of tmpfs if parent is tmpfs
-        mkdir(dest.data(), 0);
-        clone_attr(src_path ?: parent()->worker_path().data(), dest.data());
+        run_op(OP_MKDIR, dest.data());
+        run_op(OP_ATTR, src_path ?: parent()->worker_path().data(), dest.data());
         dir_node::mount();
     }
 }
@@ -191,7 +552,7 @@ public:
     explicit magisk_node(const char *name) : node_entry(name, DT_REG, this) {}
 
     void mount() override {
-        const string src = get_magisk_tmp() + "/"s + name();
+        const string src = get_magisk_tmp() + "/"s + name().data();
         if (access(src.data(), F_OK))
             return;
 
@@ -200,12 +561,12 @@ public:
             for (int i = 0; applet_names[i]; ++i) {
                 string dest = dir_name + "/" + applet_names[i];
                 VLOGD("create", "./magisk", dest.data());
-                xsymlink("./magisk", dest.data());
+                run_op(OP_SYMLINK, "./magisk", dest.data());
             }
         } else {
             string dest = dir_name + "/supolicy";
             VLOGD("create", "./magiskpolicy", dest.data());
-            xsymlink("./magiskpolicy", dest.data());
+            run_op(OP_SYMLINK, "./magiskpolicy", dest.data());
         }
         create_and_mount("magisk", src, true);
     }
@@ -262,17 +623,240 @@ static void inject_zygisk_libs(root_node *system) {
     }
 }
 
-vector<module_info> *module_list;
+/******************
+ * Overlay Backend
+ ******************/
 
-void load_modules() {
-    node_entry::mirror_dir = get_magisk_tmp() + "/"s MIRRDIR;
-    node_entry::module_mnt =  get_magisk_tmp() + "/"s MODULEMNT "/";
+// Instead of one bind mount per module file, mount a single read-only overlayfs on
+// every top level directory of each partition, using the module directories as lower
+// layers in module order on top of the original directory. Our own binaries are hard
+// linked into an extra layer on top of all modules.
+
+static void append_lowerdir(string &opts, string_view dir) {
+    opts += opts.empty() ? "lowerdir=" : ":";
+    for (char c : dir) {
+        // Escape characters that are separators in overlayfs options
+        if (c == ':' || c == ',' || c == '\\')
+            opts += '\\';
+        opts += c;
+    }
+}
+
+static bool is_dir(const char *path) {
+    struct stat st{};
+    return stat(path, &st) == 0 && S_ISDIR(st.st_mode);
+}
 
+static bool overlay_supported() {
+    bool found = false;
+    file_readline(true, "/proc/filesystems", [&](string_view line) -> bool {
+        found = line.ends_with("\toverlay");
+        return !found;
+    });
+    return found;
+}
+
+static void build_magisk_layer(const string &layer, bool inject_bins) {
+    string tmp = get_magisk_tmp();
+    if (inject_bins) {
+        string dir = layer + "/system/bin";
+        for (const char *name : { "magisk", "magiskpolicy" }) {
+            string src = tmp + "/" + name;
+            if (access(src.data(), F_OK) == 0)
+                run_op(OP_LINK, src.data(), (dir + "/" + name).data());
+        }
+        // Also override all applets to make sure no modules can override it
+        for (int i = 0; applet_names[i]; ++i)
+            run_op(OP_SYMLINK, "./magisk", (dir + "/" + applet_names[i]).data());
+        run_op(OP_SYMLINK, "./magiskpolicy", (dir + "/supolicy").data());
+    }
+    if (zygisk_enabled) {
+        for (const char *abi : { "", "64" }) {
+            if (access(("/system/bin/linker"s + abi).data(), F_OK) != 0)
+                continue;
+            string dir = layer + "/system/lib" + abi;
+            string src = tmp + "/magisk" + (abi[0] ? abi : "32");
+            run_op(OP_LINK, src.data(), (dir + "/" + native_bridge).data());
+        }
+    }
+}
+
+static bool has_replace(const dir_node *dir) {
+    if (dir->is_replace())
+        return true;
+    for (auto &pair : dir->entries()) {
+        if (auto dn = dyn_cast<dir_node>(pair.second); dn && has_replace(dn))
+            return true;
+    }
+    return false;
+}
+
+// A merged directory takes its attributes from the top layer, so every directory gets
+// a copy in our layer with the attributes magic mount would give its tmpfs counterpart.
+// Module files inherit the attributes of the files they replace, same as magic mount.
+// A .replace only hides the original directory: the opaque copy lives in a layer right
+// above the mirror, so modules below the one with .replace still get merged.
+static void build_overlay_layers(dir_node *dir, const string &parent_src,
+                                 const string &layer, const string &replace) {
+    string path = dir->node_path();
+    string mirror = dir->mirror_path();
+    const string &src = access(mirror.data(), F_OK) == 0 ? mirror : parent_src;
+    string top = layer + path;
+    run_op(OP_MKDIRS, top.data());
+    run_op(OP_ATTR, src.data(), top.data());
+    if (dir->is_replace()) {
+        string opaque = replace + path;
+        run_op(OP_MKDIRS, opaque.data());
+        run_op(OP_OPAQUE, opaque.data());
+    }
+    for (auto &pair : dir->entries()) {
+        if (auto dn = dyn_cast<dir_node>(pair.second)) {
+            build_overlay_layers(dn, src, layer, replace);
+        } else if (auto mn = dyn_cast<module_node>(pair.second)) {
+            string orig = mn->mirror_path();
+            if (access(orig.data(), F_OK) == 0)
+                run_op(OP_ATTR, orig.data(), (MODULEROOT "/" + mn->module_path()).data());
+        }
+    }
+}
+
+// Return false if the tree cannot be mounted with overlayfs, nothing is touched in that case
+static bool overlay_mount(root_node *root, const vector<const char *> &modules, bool inject_bins) {
+    if (!overlay_supported()) {
+        LOGW("* overlayfs is not supported, fallback to magic mount\n");
+        return false;
+    }
+
+    string layer = get_magisk_tmp() + "/"s OVERLAYDIR;
+    string replace = get_magisk_tmp() + "/"s REPLACEDIR;
+
+    // overlayfs options have to fit in a single page
+    const size_t max_opts = getpagesize() - 1;
+    vector<pair<string, string>> overlays;
+    vector<pair<string, string>> binds;
+    vector<pair<dir_node *, root_node *>> dirs;
+    for (auto &part : root->entries()) {
+        auto r = dyn_cast<root_node>(part.second);
+        if (!r)
+            continue;
+        for (auto &pair : r->entries()) {
+            node_entry *node = pair.second;
+            string target = node->node_path();
+            struct stat st{};
+            if (lstat(target.data(), &st) != 0 || S_ISLNK(st.st_mode) ||
+                    node->is_dir() != S_ISDIR(st.st_mode)) {
+                LOGW("Unable to add: %s, skipped\n", target.data());
+                continue;
+            }
+            if (!node->is_dir()) {
+                // Files directly in the partition root still need bind mounts
+                if (!isa<module_node>(node))
+                    continue;
+                for (const char *module : modules) {
+                    string src = node_entry::module_mnt + module + r->prefix + target;
+                    if (access(src.data(), F_OK) == 0) {
+                        binds.emplace_back(std::move(src), std::move(target));
+                        break;
+                    }
+                }
+                continue;
+            }
+
+            auto dn = dyn_cast<dir_node>(node);
+            string opts;
+            append_lowerdir(opts, layer + target);
+            for (const char *module : modules) {
+                string dir = node_entry::module_mnt + module + r->prefix + target;
+                if (is_dir(dir.data()))
+                    append_lowerdir(opts, dir);
+            }
+            if (has_replace(dn))
+                append_lowerdir(opts, replace + target);
+            string mirror = node->mirror_path();
+            append_lowerdir(opts, access(mirror.data(), F_OK) == 0 ? mirror : target);
+            if (opts.size() > max_opts) {
+                LOGW("* Too many layers for %s, fallback to magic mount\n", target.data());
+                return false;
+            }
+            dirs.emplace_back(dn, r);
+            overlays.emplace_back(std::move(opts), std::move(target));
+        }
+    }
+
+    for (auto [dn, r] : dirs) {
+        build_overlay_layers(dn, r->mirror_path(), layer, replace);
+    }
+    build_magisk_layer(layer, inject_bins);
+
+    for (auto &[opts, target] : overlays) {
+        VLOGD("overlay", opts.data(), target.data());
+        run_op(OP_OVERLAY, opts.data(), target.data());
+    }
+    for (auto &[src, target] : binds) {
+        bind_mount("module", src.data(), target.data());
+    }
+
+    // special case for /system/etc/hosts to ensure it is writable
+    auto etc = dyn_cast<dir_node>(root->get_child<dir_node>("system")->get_child<node_entry>("etc"));
+    if (etc && isa<module_node>(etc->get_child<node_entry>("hosts"))) {
+        for (const char *module : modules) {
+            string src = MODULEROOT "/"s + module + "/system/etc/hosts";
+            if (access(src.data(), F_OK) == 0) {
+                bind_mount("module", src.data(), "/system/etc/hosts");
+                break;
+            }
+        }
+    }
+    return true;
+}
+
+vector<module_info> *module_list;
+int module_bundle32 = -1;
+#if defined(__LP64__)
+int module_bundle64 = -1;
+#endif
+
+static void magic_mount(const vector<const char *> &modules, bool inject_bins) {
     auto root = make_unique<root_node>("");
     auto system = new root_node("system");
     root->insert(system);
 
+    collect_modules_files(system, modules);
+    if (inject_bins) {
+        // Need to inject our binaries into /system/bin
+        inject_magisk_bins(system);
+    }
+    if (zygisk_enabled) {
+        inject_zygisk_libs(system);
+    }
+
+    if (!system->is_empty()) {
+        // Handle special read-only partitions
+        for (const char *part : { "/vendor", "/product", "/system_ext" }) {
+            struct stat st{};
+            if (lstat(part, &st) == 0 && S_ISDIR(st.st_mode)) {
+                if (auto old = system->extract(part + 1)) {
+                    auto new_node = new root_node(old);
+                    root->insert(new_node);
+                }
+            }
+        }
+        if (mount_mode != MOUNT_MODE_OVERLAY || !overlay_mount(root.get(), modules, inject_bins)) {
+            root->prepare();
+            root->mount();
+        }
+    }
+    root.reset();
+    node_arena::reset();
+}
+
+void load_modules() {
+    node_entry::mirror_dir = get_magisk_tmp() + "/"s MIRRDIR;
+    node_entry::module_mnt =  get_magisk_tmp() + "/"s MODULEMNT "/";
+
     char buf[4096];
+    vector<const char *> modules;
+    vector<string> prop_files;
     LOGI("* Loading modules\n");
     for (const auto &m : *module_list) {
         const char *module = m.name.data();
@@ -282,8 +866,7 @@ void load_modules() {
         strcpy(b, "system.prop");
         if (access(buf, F_OK) == 0) {
             LOGI("%s: loading [system.prop]\n", module);
-            // Do NOT go through property service as it could cause boot lock
-            load_prop_file(buf, true);
+            prop_files.emplace_back(buf);
         }
 
         // Check whether skip mounting
@@ -297,15 +880,17 @@ void load_modules() {
             continue;
 
         LOGI("%s: loading mount files\n", module);
-        b[-1] = '\0';
-        int fd = xopen(buf, O_RDONLY | O_CLOEXEC);
-        system->collect_module_files(module, fd);
-        close(fd);
+        modules.push_back(module);
     }
-    if (get_magisk_tmp() != "/sbin"sv || !str_contains(getenv("PATH") ?: "", "/sbin")) {
-        // Need to inject our binaries into /system/bin
-        inject_magisk_bins(system);
+    if (!prop_files.empty()) {
+        vector<const char *> files;
+        for (auto &file : prop_files)
+            files.push_back(file.data());
+        // Do NOT go through property service as it could cause boot lock
+        load_prop_files(files, true);
     }
+    bool inject_bins =
+            get_magisk_tmp() != "/sbin"sv || !str_contains(getenv("PATH") ?: "", "/sbin");
 
     if (zygisk_enabled) {
         string native_bridge_orig = get_prop(NBPROP);
@@ -320,22 +905,18 @@ void load_modules() {
         if (get_prop("ro.maple.enable") == "1") {
             set_prop("ro.maple.enable", "0");
         }
-        inject_zygisk_libs(system);
     }
 
-    if (!system->is_empty()) {
-        // Handle special read-only partitions
-        for (const char *part : { "/vendor", "/product", "/system_ext" }) {
-            struct stat st{};
-            if (lstat(part, &st) == 0 && S_ISDIR(st.st_mode)) {
-                if (auto old = system->extract(part + 1)) {
-                    auto new_node = new root_node(old);
-                    root->insert(new_node);
-                }
-            }
-        }
-        root->prepare();
-        root->mount();
+    string key = mount_plan_key(modules, inject_bins);
+    if (!replay_mount_plan(key)) {
+        string plan = key;
+        plan.push_back('\0');
+        mount_plan = &plan;
+        magic_mount(modules, inject_bins);
+        mount_plan = nullptr;
+        // Only save if every operation succeeded
+        if (!plan.empty())
+            save_mount_plan(plan);
     }
 
     ssprintf(buf, sizeof(buf), "%s/" WORKERDIR, get_magisk_tmp());
@@ -369,6 +950,7 @@ static void prepare_modules() {
         }
         close(mfd);
         rm_rf(MODULEUPGRADE);
+        invalidate_mount_plan();
     }
 }
 
@@ -388,6 +970,62 @@ static void foreach_module(Func fn) {
     }
 }
 
+static inline size_t align_bundle(size_t off) {
+    return (off + MODULE_BUNDLE_ALIGN - 1) & ~(size_t) (MODULE_BUNDLE_ALIGN - 1);
+}
+
+// Pack the zygisk libraries of all modules into a single file, see module_bundle_entry
+static int build_module_bundle(int module_info::*lib) {
+    int fd = syscall(__NR_memfd_create, "jit-cache", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    bool sealable = fd >= 0;
+    if (fd < 0) {
+        // memfd_create is not supported, use an unlinked file in tmpfs instead
+        char buf[4096];
+        ssprintf(buf, sizeof(buf), "%s/jit-cache.XXXXXX", get_magisk_tmp());
+        fd = mkostemp(buf, O_CLOEXEC);
+        if (fd < 0)
+            return -1;
+        unlink(buf);
+    }
+
+    auto cnt = static_cast<uint32_t>(module_list->size());
+    vector<module_bundle_entry> table(cnt);
+    size_t off = align_bundle(sizeof(cnt) + cnt * sizeof(module_bundle_entry));
+    bool empty = true;
+    for (uint32_t i = 0; i < cnt; ++i) {
+        int &src = (*module_list)[i].*lib;
+        if (src < 0)
+            continue;
+        lseek(fd, off, SEEK_SET);
+        ssize_t sz = xsendfile(fd, src, nullptr, INT_MAX);
+        close(src);
+        src = -1;
+        if (sz <= 0)
+            continue;
+        table[i] = { static_cast<uint32_t>(off), static_cast<uint32_t>(sz) };
+        off = align_bundle(off + sz);
+        empty = false;
+    }
+    if (empty) {
+        close(fd);
+        return -1;
+    }
+
+    pwrite(fd, &cnt, sizeof(cnt), 0);
+    pwrite(fd, table.data(), cnt * sizeof(module_bundle_entry), sizeof(cnt));
+    if (sealable) {
+        fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL);
+    } else {
+        // The fd is shared with zygote and all its children, never hand out a writable one
+        char buf[32];
+        ssprintf(buf, sizeof(buf), "/proc/self/fd/%d", fd);
+        int ro = xopen(buf, O_RDONLY | O_CLOEXEC);
+        close(fd);
+        fd = ro;
+    }
+    return fd;
+}
+
 static void collect_modules(bool open_zygisk) {
     foreach_module([=](int dfd, dirent *entry, int modfd) {
         if (faccessat(modfd, "remove", F_OK, 0) == 0) {
@@ -399,7 +1037,8 @@ static void collect_modules(bool open_zygisk) {
             unlinkat(dfd, entry->d_name, AT_REMOVEDIR);
             return;
         }
-        unlinkat(modfd, "update", 0);
+        if (unlinkat(modfd, "update", 0) == 0)
+            invalidate_mount_plan();
         if (faccessat(modfd, "disable", F_OK, 0) == 0)
             return;
 
@@ -437,29 +1076,12 @@ static void collect_modules(bool open_zygisk) {
         module_list->push_back(info);
     });
     if (zygisk_enabled) {
-        bool use_memfd = true;
-        auto convert_to_memfd = [&](int fd) -> int {
-            if (fd < 0)
-                return -1;
-            if (use_memfd) {
-                int memfd = syscall(__NR_memfd_create, "jit-cache", MFD_CLOEXEC);
-                if (memfd >= 0) {
-                    xsendfile(memfd, fd, nullptr, INT_MAX);
-                    close(fd);
-                    return memfd;
-                } else {
-                    // memfd_create failed, just use what we had
-                    use_memfd = false;
-                }
-            }
-            return fd;
-        };
-        std::for_each(module_list->begin(), module_list->end(), [&](module_info &info) {
-            info.z32 = convert_to_memfd(info.z32);
+        close(module_bundle32);
+        module_bundle32 = build_module_bundle(&module_info::z32);
 #if defined(__LP64__)
-            info.z64 = convert_to_memfd(info.z64);
+        close(module_bundle64);
+        module_bundle64 = build_module_bundle(&module_info::z64);
 #endif
-        });
     }
 }
 
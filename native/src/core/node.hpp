@@ -1,7 +1,8 @@
 #pragma once
 
 #include <sys/mount.h>
-#include <map>
+#include <vector>
+#include <algorithm>
 
 using namespace std;
 
@@ -13,6 +14,16 @@ using namespace std;
 #define TYPE_CUSTOM  (1 << 5)    /* custom node type overrides all */
 #define TYPE_DIR     (TYPE_INTER|TYPE_TMPFS|TYPE_ROOT)
 
+// Bump allocator for the node tree. Nodes and their names are never freed individually,
+// all memory is released at once with reset() after magic mount is done.
+class node_arena {
+public:
+    static void *alloc(size_t sz, size_t align = alignof(max_align_t));
+    // Copy the string into the arena, the returned view is always null terminated
+    static string_view dup(string_view str);
+    static void reset();
+};
+
 class node_entry;
 class dir_node;
 class inter_node;
@@ -36,16 +47,19 @@ class node_entry {
 public:
     virtual ~node_entry() = default;
 
+    static void *operator new(size_t sz) { return node_arena::alloc(sz); }
+    static void operator delete(void *) {}
+
     // Node info
     bool is_dir() const { return file_type() == DT_DIR; }
     bool is_lnk() const { return file_type() == DT_LNK; }
     bool is_reg() const { return file_type() == DT_REG; }
-    const string &name() const { return _name; }
+    string_view name() const { return _name; }
     dir_node *parent() const { return _parent; }
 
-    // Don't call the following two functions before prepare
-    const string &node_path();
-    const string worker_path();
+    // Paths are constructed on demand, don't call them before the tree is complete
+    string node_path() const;
+    string worker_path() const;
 
     string mirror_path() { return mirror_dir + node_path(); }
 
@@ -57,13 +71,13 @@ public:
 protected:
     template<class T>
     node_entry(const char *name, uint8_t file_type, T*)
-    : _name(name), _file_type(file_type & 15), _node_type(type_id<T>()) {}
+    : _name(node_arena::dup(name)), _file_type(file_type & 15), _node_type(type_id<T>()) {}
 
     template<class T>
     explicit node_entry(T*) : _file_type(0), _node_type(type_id<T>()) {}
 
     virtual void consume(node_entry *other) {
-        _name.swap(other->_name);
+        _name = other->_name;
         _file_type = other->_file_type;
         _parent = other->_parent;
         delete other;
@@ -84,19 +98,17 @@ private:
     uint8_t file_type() const { return static_cast<uint8_t>(_file_type & 15); }
 
     // Node properties
-    string _name;
+    string_view _name;
     dir_node *_parent = nullptr;
 
-    // Cache, it should only be used within prepare
-    string _node_path;
-
     uint8_t _file_type;
     const uint8_t _node_type;
 };
 
 class dir_node : public node_entry {
 public:
-    using map_type = map<string_view, node_entry *>;
+    // Children are kept in a flat vector sorted by name
+    using map_type = vector<pair<string_view, node_entry *>>;
     using iterator = map_type::iterator;
 
     ~dir_node() override {
@@ -112,6 +124,10 @@ public:
     // Traverse through module directories to generate a tree of module files
     void collect_module_files(const char *module, int dfd);
 
+    // Move all nodes of another module file tree into this tree.
+    // The result is the same as collecting the other module after this one.
+    void merge(dir_node *other);
+
     // Traverse through the real filesystem and prepare the tree for magic mount.
     // Return true to indicate that this node needs to be upgraded to tmpfs_node.
     bool prepare();
@@ -128,8 +144,13 @@ public:
 
     bool is_empty() { return children.empty(); }
 
+    const map_type &entries() const { return children; }
+
+    // Whether a module requested to replace this directory, only accurate before prepare
+    bool is_replace() const { return skip_mirror(); }
+
     template<class T>
-    T *get_child(string_view name) { return iterator_to_node<T>(children.find(name)); }
+    T *get_child(string_view name) { return iterator_to_node<T>(find(name)); }
 
     root_node *root() {
         if (!_root)
@@ -139,7 +160,7 @@ public:
 
     // Return child with name or nullptr
     node_entry *extract(string_view name) {
-        auto it = children.find(name);
+        auto it = find(name);
         if (it != children.end()) {
             auto ret = it->second;
             children.erase(it);
@@ -164,9 +185,13 @@ public:
     // Return upgraded node or null if rejected
     template<class T, class ...Args>
     T *upgrade(string_view name, Args &...args) {
-        return iterator_to_node<T>(upgrade<T>(children.find(name), args...));
+        return iterator_to_node<T>(upgrade<T>(find(name), args...));
     }
 
+    // Insert all nodes with the same rules as insert(node), rejected nodes are deleted.
+    // Merging a sorted batch is much cheaper than inserting nodes one by one.
+    void insert(vector<node_entry *> &nodes);
+
 protected:
     template<class T>
     dir_node(const char *name, T *self) : node_entry(name, DT_DIR, self) {
@@ -183,9 +208,21 @@ protected:
 
     void consume(node_entry *other) override {
         if (auto o = dyn_cast<dir_node>(other)) {
-            children.merge(o->children);
-            for (auto &pair : children)
+            map_type merged;
+            merged.reserve(children.size() + o->children.size());
+            std::merge(children.begin(), children.end(), o->children.begin(), o->children.end(),
+                       back_inserter(merged), name_less);
+            children.clear();
+            for (auto &pair : merged) {
+                // Our own node comes first and wins on conflict
+                if (!children.empty() && children.back().first == pair.first) {
+                    delete pair.second;
+                    continue;
+                }
                 pair.second->_parent = this;
+                children.push_back(pair);
+            }
+            o->children.clear();
         }
         node_entry::consume(other);
     }
@@ -200,9 +237,24 @@ protected:
         return static_cast<T*>(it == children.end() ? nullptr : it->second);
     }
 
+    static bool name_less(const map_type::value_type &a, const map_type::value_type &b) {
+        return a.first < b.first;
+    }
+
+    // Position of the first child not less than name
+    iterator lower_bound(string_view name) {
+        return std::lower_bound(children.begin(), children.end(), name,
+                                [](const auto &pair, string_view n) { return pair.first < n; });
+    }
+
+    iterator find(string_view name) {
+        auto it = lower_bound(name);
+        return it != children.end() && it->first == name ? it : children.end();
+    }
+
     template<typename Builder>
     iterator insert(string_view name, uint8_t type, const Builder &builder) {
-        return insert_at(children.find(name), type, builder);
+        return insert_at(find(name), type, builder);
     }
 
     // Emplace insert a new node, or upgrade if the requested type has a higher rank.
@@ -222,12 +274,8 @@ protected:
                     return children.end();
                 if (it->second)
                     node->consume(it->second);
-                it = children.erase(it);
-                // Minor optimization to make insert O(1) by using hint
-                if (it == children.begin())
-                    it = children.emplace(node->_name, node).first;
-                else
-                    it = children.emplace_hint(--it, node->_name, node);
+                // The name stays the same, replace in place to keep the order
+                *it = { node->_name, node };
             } else {
                 return children.end();
             }
@@ -236,7 +284,7 @@ protected:
             if (!node)
                 return children.end();
             node->_parent = this;
-            it = children.emplace(node->_name, node).first;
+            it = children.emplace(lower_bound(node->_name), node->_name, node);
         }
         return it;
     }
@@ -285,6 +333,9 @@ public:
     }
 
     void mount() override;
+
+    // Path of the source file relative to the module root
+    string module_path() { return module + (parent()->root()->prefix + node_path()); }
 private:
     const char *module;
 };
@@ -311,12 +362,15 @@ static T *dyn_cast(node_entry *node) {
     return isa<T>(node) ? static_cast<T*>(node) : nullptr;
 }
 
-const string &node_entry::node_path() {
-    if (_parent && _node_path.empty())
-        _node_path = _parent->node_path() + '/' + _name;
-    return _node_path;
+string node_entry::node_path() const {
+    if (!_parent)
+        return {};
+    string path = _parent->node_path();
+    path += '/';
+    path += _name;
+    return path;
 }
 
-const string node_entry::worker_path() {
+string node_entry::worker_path() const {
     return get_magisk_tmp() + "/"s WORKERDIR + node_path();
 }
@@ -1,3 +1,5 @@
+#include <sys/inotify.h>
+
 #include <base.hpp>
 #include <consts.hpp>
 #include <core.hpp>
@@ -27,6 +29,163 @@ static bool operator==(const Vec<uint8_t> &a, const Vec<uint8_t> &b) {
     return a.size() == b.size() && memcmp(a.data(), b.data(), a.size()) == 0;
 }
 
+// Package index
+//
+// Scanning every package data directory of every user is expensive, so an index of
+// all installed packages is built once and then kept up to date with inotify events
+// on APP_DATA_DIR and each user directory within it. Only changed entries are updated.
+
+#define USERS_DIR_MASK (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_ONLYDIR)
+// App data directories are chown-ed after creation, watch IN_ATTRIB to catch the app ID
+#define USER_DIR_MASK  (USERS_DIR_MASK | IN_ATTRIB)
+
+static pthread_mutex_t index_lock = PTHREAD_MUTEX_INITIALIZER;
+// index_lock protects all following variables
+// user ID -> package name -> app ID
+static map<int, map<string, int, StringCmp>> *user_pkgs;
+// inotify watch descriptor -> user ID, -1 for APP_DATA_DIR
+static map<int, int> *watch_users;
+static shared_ptr<const pkg_index> index_snapshot;
+static int index_fd = -1;
+
+static void scan_user(int user_id) {
+    char path[128];
+    ssprintf(path, sizeof(path), "%s/%d", APP_DATA_DIR, user_id);
+    if (index_fd >= 0) {
+        // Watch before scanning so no event is missed
+        if (int wd = inotify_add_watch(index_fd, path, USER_DIR_MASK); wd >= 0)
+            (*watch_users)[wd] = user_id;
+    }
+    auto &pkgs = (*user_pkgs)[user_id];
+    pkgs.clear();
+    int dfd = xopen(path, O_RDONLY | O_CLOEXEC);
+    if (auto dir = xopen_dir(dfd)) {
+        dirent *entry;
+        while ((entry = xreaddir(dir.get()))) {
+            // For each package
+            struct stat st{};
+            if (xfstatat(dfd, entry->d_name, &st, 0) == 0)
+                pkgs[entry->d_name] = to_app_id(st.st_uid);
+        }
+    } else {
+        close(dfd);
+    }
+}
+
+static void scan_all_users() {
+    user_pkgs->clear();
+    auto data_dir = xopen_dir(APP_DATA_DIR);
+    if (!data_dir)
+        return;
+    dirent *entry;
+    while ((entry = xreaddir(data_dir.get()))) {
+        // For each user
+        if (int u = parse_int(entry->d_name); u >= 0)
+            scan_user(u);
+    }
+}
+
+static void publish_index() {
+    auto index = make_shared<pkg_index>();
+    for (const auto &[user_id, pkgs] : *user_pkgs) {
+        for (const auto &[pkg, app_id] : pkgs) {
+            index->try_emplace(pkg, app_id);
+        }
+    }
+    index_snapshot = std::move(index);
+}
+
+// Returns true if the index is changed
+static bool handle_index_event(const inotify_event *event) {
+    if (event->mask & IN_Q_OVERFLOW) {
+        // Events are lost, start over
+        scan_all_users();
+        return true;
+    }
+    auto it = watch_users->find(event->wd);
+    if (it == watch_users->end())
+        return false;
+    int user_id = it->second;
+    if (event->mask & IN_IGNORED) {
+        watch_users->erase(it);
+        return user_id >= 0 && user_pkgs->erase(user_id) != 0;
+    }
+    if (event->len == 0)
+        return false;
+
+    if (user_id < 0) {
+        // A user is added or removed
+        int u = parse_int(event->name);
+        if (u < 0)
+            return false;
+        if (event->mask & (IN_CREATE | IN_MOVED_TO))
+            scan_user(u);
+        else
+            user_pkgs->erase(u);
+        return true;
+    }
+
+    // A package is added, removed, or its owner changed
+    auto &pkgs = (*user_pkgs)[user_id];
+    if (event->mask & (IN_DELETE | IN_MOVED_FROM))
+        return pkgs.erase(event->name) != 0;
+    char path[PATH_MAX];
+    ssprintf(path, sizeof(path), "%s/%d/%s", APP_DATA_DIR, user_id, event->name);
+    struct stat st{};
+    if (stat(path, &st) != 0)
+        return false;
+    int app_id = to_app_id(st.st_uid);
+    auto [pkg, inserted] = pkgs.try_emplace(event->name, app_id);
+    if (!inserted) {
+        if (pkg->second == app_id)
+            return false;
+        pkg->second = app_id;
+    }
+    return true;
+}
+
+static void index_handler(pollfd *pfd) {
+    alignas(inotify_event) char buf[4096];
+    bool changed = false;
+    mutex_guard g(index_lock);
+    for (ssize_t len; (len = read(pfd->fd, buf, sizeof(buf))) > 0;) {
+        for (char *p = buf; p < buf + len;) {
+            auto event = reinterpret_cast<const inotify_event *>(p);
+            p += sizeof(inotify_event) + event->len;
+            changed |= handle_index_event(event);
+        }
+    }
+    if (changed) {
+        publish_index();
+        skip_pkg_rescan.clear();
+    }
+}
+
+shared_ptr<const pkg_index> get_pkg_index() {
+    mutex_guard g(index_lock);
+    if (index_snapshot)
+        return index_snapshot;
+
+    if (user_pkgs == nullptr) {
+        default_new(user_pkgs);
+        default_new(watch_users);
+        index_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if (index_fd >= 0) {
+            if (int wd = inotify_add_watch(index_fd, APP_DATA_DIR, USERS_DIR_MASK); wd >= 0) {
+                (*watch_users)[wd] = -1;
+                pollfd pfd = { index_fd, POLLIN, 0 };
+                register_poll(&pfd, index_handler);
+            } else {
+                close(index_fd);
+                index_fd = -1;
+            }
+        }
+    }
+    scan_all_users();
+    publish_index();
+    return index_snapshot;
+}
+
 void check_pkg_refresh() {
     mutex_guard g(pkg_lock);
     if (app_ts == nullptr)
@@ -39,35 +198,26 @@ void check_pkg_refresh() {
     }
     skip_mgr_check = false;
     skip_pkg_rescan.clear();
+    {
+        // Without inotify, the index has to be rebuilt on the next use
+        mutex_guard lock(index_lock);
+        if (index_fd < 0)
+            index_snapshot.reset();
+    }
 }
 
 // app_id = app_no + AID_APP_START
 // app_no range: [0, 9999]
 vector<bool> get_app_no_list() {
     vector<bool> list;
-    auto data_dir = xopen_dir(APP_DATA_DIR);
-    if (!data_dir)
-        return list;
-    dirent *entry;
-    while ((entry = xreaddir(data_dir.get()))) {
-        // For each user
-        int dfd = xopenat(dirfd(data_dir.get()), entry->d_name, O_RDONLY);
-        if (auto dir = xopen_dir(dfd)) {
-            while ((entry = xreaddir(dir.get()))) {
-                // For each package
-                struct stat st{};
-                xfstatat(dfd, entry->d_name, &st, 0);
-                int app_id = to_app_id(st.st_uid);
-                if (app_id >= AID_APP_START && app_id <= AID_APP_END) {
-                    int app_no = app_id - AID_APP_START;
-                    if (list.size() <= app_no) {
-                        list.resize(app_no + 1);
-                    }
-                    list[app_no] = true;
-                }
+    auto index = get_pkg_index();
+    for (const auto &[pkg, app_id] : *index) {
+        if (app_id >= AID_APP_START && app_id <= AID_APP_END) {
+            int app_no = app_id - AID_APP_START;
+            if (list.size() <= app_no) {
+                list.resize(app_no + 1);
             }
-        } else {
-            close(dfd);
+            list[app_no] = true;
         }
     }
     return list;
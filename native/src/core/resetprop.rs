@@ -1,4 +1,6 @@
-pub use persist::{persist_delete_prop, persist_get_prop, persist_get_props, persist_set_prop};
+pub use persist::{
+    persist_delete_prop, persist_get_prop, persist_get_props, persist_set_prop, persist_set_props,
+};
 
 mod persist;
 mod proto;
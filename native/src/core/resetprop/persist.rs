@@ -2,23 +2,26 @@ use std::io::Read;
 use std::{
     fs::File,
     io::{BufWriter, Write},
+    mem,
     ops::{Deref, DerefMut},
     os::fd::FromRawFd,
     pin::Pin,
+    sync::Mutex,
 };
 
 use quick_protobuf::{BytesReader, MessageRead, MessageWrite, Writer};
 
-use base::libc::{O_CLOEXEC, O_RDONLY};
+use base::libc::{self, O_CLOEXEC, O_RDONLY};
 use base::{
     clone_attr, cstr, debug, libc::mkstemp, Directory, FsPath, FsPathBuf, LibcReturn, LoggedResult,
     MappedFile, ResultNoLog, Utf8CStr, Utf8CStrBufArr, WalkResult,
 };
 
-use crate::ffi::{prop_cb_exec, PropCb};
+use crate::ffi::{get_magisk_tmp, prop_cb_exec, PropCb};
 use crate::resetprop::proto::persistent_properties::{
     mod_PersistentProperties::PersistentPropertyRecord, PersistentProperties,
 };
+use crate::PERSIST_SNAPSHOT;
 
 macro_rules! PERSIST_PROP_DIR {
     () => {
@@ -58,7 +61,7 @@ impl DerefMut for PersistentProperties {
 
 trait PropExt {
     fn find_index(&self, name: &Utf8CStr) -> Result<usize, usize>;
-    fn find(&mut self, name: &Utf8CStr) -> LoggedResult<&mut PersistentPropertyRecord>;
+    fn set(&mut self, name: &Utf8CStr, value: &Utf8CStr);
 }
 
 impl PropExt for PersistentProperties {
@@ -66,9 +69,17 @@ impl PropExt for PersistentProperties {
         self.binary_search_by(|p| p.name.as_deref().cmp(&Some(name.deref())))
     }
 
-    fn find(&mut self, name: &Utf8CStr) -> LoggedResult<&mut PersistentPropertyRecord> {
-        let idx = self.find_index(name).no_log()?;
-        Ok(&mut self[idx])
+    fn set(&mut self, name: &Utf8CStr, value: &Utf8CStr) {
+        match self.find_index(name) {
+            Ok(idx) => self[idx].value = Some(value.to_string()),
+            Err(idx) => self.insert(
+                idx,
+                PersistentPropertyRecord {
+                    name: Some(name.to_string()),
+                    value: Some(value.to_string()),
+                },
+            ),
+        }
     }
 }
 
@@ -111,6 +122,7 @@ fn file_set_prop(name: &Utf8CStr, value: Option<&Utf8CStr>) -> LoggedResult<()>
         path.remove().no_log()?;
         debug!("resetprop: unlink [{}]", path);
     }
+    invalidate_snapshot();
     Ok(())
 }
 
@@ -138,51 +150,135 @@ fn proto_write_props(props: &PersistentProperties) -> LoggedResult<()> {
     }
     clone_attr(FsPath::from(cstr!(PERSIST_PROP!())), &tmp)?;
     tmp.rename_to(cstr!(PERSIST_PROP!()))?;
+    invalidate_snapshot();
     Ok(())
 }
 
-pub unsafe fn persist_get_prop(name: &Utf8CStr, prop_cb: Pin<&mut PropCb>) {
-    fn inner(name: &Utf8CStr, mut prop_cb: Pin<&mut PropCb>) -> LoggedResult<()> {
-        if check_proto() {
-            let mut props = proto_read_props()?;
-            let prop = props.find(name)?;
-            if let PersistentPropertyRecord {
-                name: Some(ref mut n),
-                value: Some(ref mut v),
-            } = prop
-            {
-                prop_cb.exec(Utf8CStr::from_string(n), Utf8CStr::from_string(v));
+// All persistent props in a compact binary format that can be binary searched in place.
+// Layout, all integers in native endian:
+//   header:  u32 magic, u32 count, u64 storage id[4]
+//   entries: (u32 name offset, u32 name length, u32 value offset, u32 value length) * count
+//   strings: null terminated names and values
+// Entries are sorted by name. The storage id identifies the storage the snapshot is built
+// from, so the snapshot is automatically stale once init or resetprop changes the storage.
+// The snapshot is cached in memory, which keeps lookups in magiskd cheap, and shared as a
+// file in magisk tmp for all other processes to mmap.
+
+const SNAPSHOT_MAGIC: u32 = u32::from_ne_bytes(*b"MPPS");
+const SNAPSHOT_HEADER: usize = 40;
+const SNAPSHOT_ENTRY: usize = 16;
+
+type StorageId = [u64; 4];
+
+enum SnapshotData {
+    Mapped(MappedFile),
+    Owned(Vec<u8>),
+}
+
+struct Snapshot(SnapshotData);
+
+static SNAPSHOT: Mutex<Option<Snapshot>> = Mutex::new(None);
+
+// inode, size and mtime of the protobuf file, or of the directory in legacy mode
+fn storage_id() -> LoggedResult<StorageId> {
+    let path = if check_proto() {
+        cstr!(PERSIST_PROP!())
+    } else {
+        cstr!(PERSIST_PROP_DIR!())
+    };
+    let st = unsafe {
+        let mut st: libc::stat = mem::zeroed();
+        libc::stat(path.as_ptr(), &mut st).as_os_err()?;
+        st
+    };
+    Ok([
+        st.st_ino as u64,
+        st.st_size as u64,
+        st.st_mtime as u64,
+        st.st_mtime_nsec as u64,
+    ])
+}
+
+impl Snapshot {
+    fn bytes(&self) -> &[u8] {
+        match &self.0 {
+            SnapshotData::Mapped(m) => m.as_ref(),
+            SnapshotData::Owned(v) => v,
+        }
+    }
+
+    fn u32_at(&self, off: usize) -> u32 {
+        u32::from_ne_bytes(self.bytes()[off..off + 4].try_into().unwrap())
+    }
+
+    fn len(&self) -> usize {
+        self.u32_at(4) as usize
+    }
+
+    // Check the format and return the storage id it is built from
+    fn id(&self) -> Option<StorageId> {
+        let b = self.bytes();
+        if b.len() < SNAPSHOT_HEADER || self.u32_at(0) != SNAPSHOT_MAGIC {
+            return None;
+        }
+        if b.len() < SNAPSHOT_HEADER + self.len() * SNAPSHOT_ENTRY {
+            return None;
+        }
+        let mut id = StorageId::default();
+        for (i, v) in id.iter_mut().enumerate() {
+            let off = 8 + i * 8;
+            *v = u64::from_ne_bytes(b[off..off + 8].try_into().unwrap());
+        }
+        Some(id)
+    }
+
+    fn raw_str(&self, entry: usize, field: usize) -> Option<&[u8]> {
+        let off = SNAPSHOT_HEADER + entry * SNAPSHOT_ENTRY + field * 8;
+        let start = self.u32_at(off) as usize;
+        let len = self.u32_at(off + 4) as usize;
+        self.bytes().get(start..start + len + 1)
+    }
+
+    fn entry(&self, idx: usize) -> Option<(&Utf8CStr, &Utf8CStr)> {
+        let name = Utf8CStr::from_bytes(self.raw_str(idx, 0)?).ok()?;
+        let value = Utf8CStr::from_bytes(self.raw_str(idx, 1)?).ok()?;
+        Some((name, value))
+    }
+
+    fn find(&self, name: &Utf8CStr) -> Option<(&Utf8CStr, &Utf8CStr)> {
+        let (mut lo, mut hi) = (0, self.len());
+        while lo < hi {
+            let mid = (lo + hi) / 2;
+            let n = self.raw_str(mid, 0)?;
+            match n[..n.len() - 1].cmp(name.as_bytes()) {
+                std::cmp::Ordering::Less => lo = mid + 1,
+                std::cmp::Ordering::Greater => hi = mid,
+                std::cmp::Ordering::Equal => return self.entry(mid),
             }
-        } else {
-            let mut value = file_get_prop(name)?;
-            prop_cb.exec(name, Utf8CStr::from_string(&mut value));
-            debug!("resetprop: found prop [{}] = [{}]", name, value);
         }
-        Ok(())
+        None
     }
-    inner(name, prop_cb).ok();
-}
 
-pub unsafe fn persist_get_props(prop_cb: Pin<&mut PropCb>) {
-    fn inner(mut prop_cb: Pin<&mut PropCb>) -> LoggedResult<()> {
+    fn build(id: &StorageId) -> LoggedResult<Snapshot> {
+        let mut list: Vec<(String, String)> = Vec::new();
         if check_proto() {
-            let mut props = proto_read_props()?;
-            props.iter_mut().for_each(|prop| {
+            let props = proto_read_props()?;
+            for p in props.properties {
                 if let PersistentPropertyRecord {
-                    name: Some(ref mut n),
-                    value: Some(ref mut v),
-                } = prop
+                    name: Some(n),
+                    value: Some(v),
+                } = p
                 {
-                    prop_cb.exec(Utf8CStr::from_string(n), Utf8CStr::from_string(v));
+                    list.push((n, v));
                 }
-            });
+            }
         } else {
             let mut dir = Directory::open(cstr!(PERSIST_PROP_DIR!()))?;
             dir.pre_order_walk(|e| {
                 if e.is_file() {
                     if let Ok(name) = Utf8CStr::from_cstr(e.d_name()) {
-                        if let Ok(mut value) = file_get_prop(name) {
-                            prop_cb.exec(name, Utf8CStr::from_string(&mut value));
+                        if let Ok(value) = file_get_prop(name) {
+                            list.push((name.to_string(), value));
                         }
                     }
                 }
@@ -190,8 +286,114 @@ pub unsafe fn persist_get_props(prop_cb: Pin<&mut PropCb>) {
                 Ok(WalkResult::Skip)
             })?;
         }
+        list.sort_unstable_by(|a, b| a.0.cmp(&b.0));
+
+        let mut buf = Vec::new();
+        buf.extend_from_slice(&SNAPSHOT_MAGIC.to_ne_bytes());
+        buf.extend_from_slice(&(list.len() as u32).to_ne_bytes());
+        for v in id {
+            buf.extend_from_slice(&v.to_ne_bytes());
+        }
+        let mut off = SNAPSHOT_HEADER + list.len() * SNAPSHOT_ENTRY;
+        for (name, value) in &list {
+            for s in [name, value] {
+                buf.extend_from_slice(&(off as u32).to_ne_bytes());
+                buf.extend_from_slice(&(s.len() as u32).to_ne_bytes());
+                off += s.len() + 1;
+            }
+        }
+        for (name, value) in &list {
+            for s in [name, value] {
+                buf.extend_from_slice(s.as_bytes());
+                buf.push(b'\0');
+            }
+        }
+        debug!("resetprop: build persist props snapshot");
+        Ok(Snapshot(SnapshotData::Owned(buf)))
+    }
+
+    fn save(&self, path: &FsPath) -> LoggedResult<()> {
+        let mut buf = Utf8CStrBufArr::default();
+        let mut tmp = FsPathBuf::new(&mut buf)
+            .join(get_magisk_tmp())
+            .join(concat!(PERSIST_SNAPSHOT!(), ".XXXXXX"));
+        {
+            let mut f = unsafe {
+                let fd = mkstemp(tmp.as_mut_ptr()).check_os_err()?;
+                File::from_raw_fd(fd)
+            };
+            f.write_all(self.bytes())?;
+        }
+        tmp.rename_to(path)?;
         Ok(())
     }
+}
+
+fn snapshot_path(buf: &mut Utf8CStrBufArr<4096>) -> Option<FsPathBuf<'_>> {
+    let tmp = get_magisk_tmp();
+    if tmp.is_empty() {
+        return None;
+    }
+    Some(FsPathBuf::new(buf).join(tmp).join(PERSIST_SNAPSHOT!()))
+}
+
+fn with_snapshot(f: impl FnOnce(&Snapshot)) -> LoggedResult<()> {
+    let id = storage_id()?;
+    let mut cache = SNAPSHOT.lock().unwrap();
+    if cache.as_ref().and_then(Snapshot::id) != Some(id) {
+        let mut buf = Utf8CStrBufArr::default();
+        let path = snapshot_path(&mut buf);
+        let mapped = path
+            .as_ref()
+            .and_then(|p| MappedFile::open(p).ok())
+            .map(|m| Snapshot(SnapshotData::Mapped(m)));
+        *cache = match mapped {
+            Some(s) if s.id() == Some(id) => Some(s),
+            _ => {
+                let s = Snapshot::build(&id)?;
+                if let Some(path) = path.as_ref() {
+                    s.save(path).ok();
+                }
+                Some(s)
+            }
+        };
+    }
+    if let Some(s) = cache.as_ref() {
+        f(s);
+    }
+    Ok(())
+}
+
+fn invalidate_snapshot() {
+    *SNAPSHOT.lock().unwrap() = None;
+    let mut buf = Utf8CStrBufArr::default();
+    if let Some(path) = snapshot_path(&mut buf) {
+        path.remove().ok();
+    }
+}
+
+pub unsafe fn persist_get_prop(name: &Utf8CStr, prop_cb: Pin<&mut PropCb>) {
+    fn inner(name: &Utf8CStr, mut prop_cb: Pin<&mut PropCb>) -> LoggedResult<()> {
+        with_snapshot(|s| {
+            if let Some((n, v)) = s.find(name) {
+                prop_cb.exec(n, v);
+                debug!("resetprop: found prop [{}] = [{}]", n, v);
+            }
+        })
+    }
+    inner(name, prop_cb).ok();
+}
+
+pub unsafe fn persist_get_props(prop_cb: Pin<&mut PropCb>) {
+    fn inner(mut prop_cb: Pin<&mut PropCb>) -> LoggedResult<()> {
+        with_snapshot(|s| {
+            for i in 0..s.len() {
+                if let Some((n, v)) = s.entry(i) {
+                    prop_cb.exec(n, v);
+                }
+            }
+        })
+    }
     inner(prop_cb).ok();
 }
 
@@ -213,16 +415,7 @@ pub unsafe fn persist_set_prop(name: &Utf8CStr, value: &Utf8CStr) -> bool {
     unsafe fn inner(name: &Utf8CStr, value: &Utf8CStr) -> LoggedResult<()> {
         if check_proto() {
             let mut props = proto_read_props()?;
-            match props.find_index(name) {
-                Ok(idx) => props[idx].value = Some(value.to_string()),
-                Err(idx) => props.insert(
-                    idx,
-                    PersistentPropertyRecord {
-                        name: Some(name.to_string()),
-                        value: Some(value.to_string()),
-                    },
-                ),
-            }
+            props.set(name, value);
             proto_write_props(&props)
         } else {
             file_set_prop(name, Some(value))
@@ -230,3 +423,30 @@ pub unsafe fn persist_set_prop(name: &Utf8CStr, value: &Utf8CStr) -> bool {
     }
     inner(name, value).is_ok()
 }
+
+// props contains pairs of null terminated names and values.
+// The protobuf storage is only read and written once for the whole batch.
+pub fn persist_set_props(props: &[u8]) -> bool {
+    fn inner(props: &[u8]) -> LoggedResult<()> {
+        let mut iter = props
+            .split_inclusive(|c| *c == b'\0')
+            .map(Utf8CStr::from_bytes);
+        let mut list = Vec::new();
+        while let (Some(name), Some(value)) = (iter.next(), iter.next()) {
+            list.push((name?, value?));
+        }
+        if check_proto() {
+            let mut props = proto_read_props()?;
+            for (name, value) in list {
+                props.set(name, value);
+            }
+            proto_write_props(&props)
+        } else {
+            for (name, value) in list {
+                file_set_prop(name, Some(value))?;
+            }
+            Ok(())
+        }
+    }
+    inner(props).is_ok()
+}
@@ -1,4 +1,5 @@
 #include <dlfcn.h>
+#include <regex.h>
 #include <sys/types.h>
 #include <vector>
 #include <map>
@@ -57,13 +58,24 @@ Read mode arguments:
 
 Write mode arguments:
    NAME VALUE        set property NAME as VALUE
-   -f,--file   FILE  load and set properties from FILE
+   -f,--file FILE... load and set properties from all FILEs
    -d,--delete NAME  delete property
 
 Wait mode arguments (toggled with -w):
     NAME             wait until property NAME changes
     NAME OLD_VALUE   if value of property NAME is not OLD_VALUE, get value
                      or else wait until property NAME changes
+    COND...          wait until any of the conditions is met,
+                     and print all conditions that are met
+
+Wait mode conditions:
+    NAME=VALUE       property NAME is VALUE
+    NAME!=VALUE      property NAME is not VALUE
+    NAME=            property NAME does not exist
+    NAME!=           property NAME exists
+
+Wait mode flags:
+   --timeout SECS    give up after SECS seconds
 
 General flags:
    -h,--help         show this message
@@ -75,6 +87,13 @@ Read mode flags:
    -P      only read persistent props from storage
    -Z      get property context instead of value
 
+Print all properties flags:
+   -0                print NAME and VALUE separated by NUL characters
+   --json            print as a single JSON object
+   --unsorted        print in storage order instead of sorting by name
+   --prefix PREFIX   only print properties starting with PREFIX
+   --regex  REGEX    only print properties with names matching REGEX
+
 Write mode flags:
    -n      set properties bypassing property_service
    -p      always write persistent prop changes to storage
@@ -144,7 +163,9 @@ template<> void prop_to_string<rust::String>::exec(const char *, const char *val
     serial = s;
 }
 
-static int set_prop(const char *name, const char *value, PropFlags flags) {
+// If persist_batch is set, persistent props are appended to it instead of written to storage
+static int set_prop(const char *name, const char *value, PropFlags flags,
+                    string *persist_batch = nullptr) {
     if (!check_legal_property_name(name))
         return 1;
 
@@ -183,7 +204,12 @@ static int set_prop(const char *name, const char *value, PropFlags flags) {
     // When bypassing property_service, persistent props won't be stored in storage.
     // Explicitly handle this situation.
     if (ret == 0 && flags.isSkipSvc() && flags.isPersist() && str_starts(name, "persist.")) {
-        ret = persist_set_prop(name, value) ? 0 : 1;
+        if (persist_batch) {
+            persist_batch->append(name).push_back('\0');
+            persist_batch->append(value).push_back('\0');
+        } else {
+            ret = persist_set_prop(name, value) ? 0 : 1;
+        }
     }
 
     if (ret) {
@@ -223,7 +249,7 @@ static StringType get_prop(const char *name, PropFlags flags) {
 }
 
 template<class StringType>
-static StringType wait_prop(const char *name, const char *old_value) {
+static StringType wait_prop(const char *name, const char *old_value, const timespec *timeout) {
     if (!check_legal_property_name(name))
         return {};
     auto pi = system_property_find(name);
@@ -238,7 +264,10 @@ static StringType wait_prop(const char *name, const char *old_value) {
     if (old_value == nullptr || cb.val == old_value) {
         LOGD("resetprop: waiting for prop [%s]\n", name);
         uint32_t new_serial;
-        system_property_wait(pi, cb.serial, &new_serial, nullptr);
+        if (!system_property_wait(pi, cb.serial, &new_serial, timeout)) {
+            LOGD("resetprop: wait prop [%s] timeout\n", name);
+            return {};
+        }
         read_prop_with_cb(pi, &cb);
     }
 
@@ -246,19 +275,219 @@ static StringType wait_prop(const char *name, const char *old_value) {
     return cb.val;
 }
 
-static void print_props(PropFlags flags) {
-    prop_list list;
-    prop_collector collector(list);
-    if (!flags.isPersistOnly())
-        system_property_foreach(read_prop_with_cb, &collector);
-    if (flags.isPersist())
-        persist_get_props(collector);
-    for (auto &[key, val] : list) {
-        const char *v = flags.isContext() ?
-                (__system_property_get_context(key.data()) ?: "") :
-                val.data();
-        printf("[%s]: [%s]\n", key.data(), v);
+struct WaitCond {
+    const char *arg;
+    string name;
+    bool equal;
+    const char *value;
+};
+
+static bool parse_conds(int argc, char *argv[], vector<WaitCond> &conds) {
+    for (int i = 0; i < argc; ++i) {
+        const char *arg = argv[i];
+        const char *op = strchr(arg, '=');
+        if (op == nullptr)
+            return false;
+        bool equal = op == arg || op[-1] != '!';
+        string name(arg, equal ? op : op - 1);
+        if (!check_legal_property_name(name.data()))
+            return false;
+        conds.push_back({ arg, std::move(name), equal, op + 1 });
+    }
+    return true;
+}
+
+// Wait on the global serial, which changes whenever any property changes,
+// and check all conditions each time it does.
+static int wait_conds(const vector<WaitCond> &conds, const timespec *timeout) {
+
+    timespec deadline{};
+    if (timeout) {
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        deadline.tv_sec += timeout->tv_sec;
+    }
+
+    prop_to_string<string> cb;
+    for (;;) {
+        // Read the serial before checking, so no changes can be missed
+        uint32_t serial = __system_property_area_serial();
+        bool met = false;
+        for (auto &cond : conds) {
+            cb.val.clear();
+            auto pi = system_property_find(cond.name.data());
+            if (pi)
+                read_prop_with_cb(pi, &cb);
+            // An empty value tests existence, a property can exist with an empty value
+            bool match = cond.value[0] ? cb.val == cond.value : pi == nullptr;
+            if (match == cond.equal) {
+                printf("%s\n", cond.arg);
+                met = true;
+            }
+        }
+        if (met)
+            return 0;
+
+        timespec remain{};
+        if (timeout) {
+            timespec now{};
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            remain.tv_sec = deadline.tv_sec - now.tv_sec;
+            remain.tv_nsec = deadline.tv_nsec - now.tv_nsec;
+            if (remain.tv_nsec < 0) {
+                --remain.tv_sec;
+                remain.tv_nsec += 1000000000L;
+            }
+            if (remain.tv_sec < 0) {
+                LOGD("resetprop: wait timeout\n");
+                return 1;
+            }
+        }
+        LOGD("resetprop: waiting for %zu conditions\n", conds.size());
+        system_property_wait(nullptr, serial, &serial, timeout ? &remain : nullptr);
+    }
+}
+
+struct PrintOpts {
+    enum { TEXT, NUL, JSON } format = TEXT;
+    bool sorted = true;
+    const char *prefix = nullptr;
+    const char *regex = nullptr;
+};
+
+// Properties are formatted straight into a large buffer that is only flushed when full
+struct prop_printer : prop_cb {
+    prop_printer(const PrintOpts &opts, PropFlags flags) : opts(opts), flags(flags) {
+        if (opts.regex) {
+            has_re = regcomp(&re, opts.regex, REG_EXTENDED | REG_NOSUB) == 0;
+            if (!has_re)
+                LOGE("resetprop: invalid regex [%s]\n", opts.regex);
+        }
+    }
+    ~prop_printer() {
+        if (has_re)
+            regfree(&re);
+    }
+
+    bool valid() const { return !opts.regex || has_re; }
+
+    bool filter(const char *name) const {
+        if (opts.prefix && !str_starts(name, opts.prefix))
+            return false;
+        return !has_re || regexec(&re, name, 0, nullptr, 0) == 0;
+    }
+
+    void exec(const char *name, const char *value, uint32_t) override {
+        if (!filter(name))
+            return;
+        if (flags.isContext())
+            value = __system_property_get_context(name) ?: "";
+        switch (opts.format) {
+        case PrintOpts::TEXT:
+            append("[");
+            append(name);
+            append("]: [");
+            append(value);
+            append("]\n");
+            break;
+        case PrintOpts::NUL:
+            append({ name, strlen(name) + 1 });
+            append({ value, strlen(value) + 1 });
+            break;
+        case PrintOpts::JSON:
+            append(count ? ",\n  " : "{\n  ");
+            append_json(name);
+            append(": ");
+            append_json(value);
+            break;
+        }
+        ++count;
+    }
+
+    void finish() {
+        if (opts.format == PrintOpts::JSON)
+            append(count ? "\n}\n" : "{}\n");
+        flush();
+    }
+
+    const PrintOpts &opts;
+    const PropFlags flags;
+
+private:
+    void append(string_view str) {
+        while (!str.empty()) {
+            size_t n = std::min(str.size(), sizeof(buf) - len);
+            memcpy(buf + len, str.data(), n);
+            len += n;
+            str.remove_prefix(n);
+            if (len == sizeof(buf))
+                flush();
+        }
+    }
+
+    void append_json(string_view str) {
+        append("\"");
+        size_t start = 0;
+        for (size_t i = 0; i < str.size(); ++i) {
+            auto c = static_cast<unsigned char>(str[i]);
+            if (c >= 0x20 && c != '"' && c != '\\')
+                continue;
+            append(str.substr(start, i - start));
+            char esc[8];
+            ssprintf(esc, sizeof(esc), c == '"' || c == '\\' ? "\\%c" : "\\u%04x", c);
+            append(esc);
+            start = i + 1;
+        }
+        append(str.substr(start));
+        append("\"");
     }
+
+    void flush() {
+        if (len)
+            xwrite(STDOUT_FILENO, buf, len);
+        len = 0;
+    }
+
+    regex_t re{};
+    bool has_re = false;
+    size_t count = 0;
+    size_t len = 0;
+    char buf[64 * 1024];
+};
+
+// Skip persistent props that are already printed from the property area
+struct persist_printer : prop_cb {
+    explicit persist_printer(prop_printer &printer) : printer(printer) {}
+    void exec(const char *name, const char *value, uint32_t serial) override {
+        if (printer.flags.isPersistOnly() || system_property_find(name) == nullptr)
+            printer.exec(name, value, serial);
+    }
+private:
+    prop_printer &printer;
+};
+
+static int print_props(PropFlags flags, const PrintOpts &opts) {
+    auto printer = make_unique<prop_printer>(opts, flags);
+    if (!printer->valid())
+        return 1;
+    if (opts.sorted) {
+        prop_list list;
+        prop_collector collector(list);
+        if (!flags.isPersistOnly())
+            system_property_foreach(read_prop_with_cb, &collector);
+        if (flags.isPersist())
+            persist_get_props(collector);
+        for (auto &[key, val] : list)
+            printer->exec(key.data(), val.data(), 0);
+    } else {
+        if (!flags.isPersistOnly())
+            system_property_foreach(read_prop_with_cb, printer.get());
+        if (flags.isPersist()) {
+            persist_printer pp(*printer);
+            persist_get_props(pp);
+        }
+    }
+    printer->finish();
+    return 0;
 }
 
 static int delete_prop(const char *name, PropFlags flags) {
@@ -275,12 +504,50 @@ static int delete_prop(const char *name, PropFlags flags) {
     return ret;
 }
 
-static void load_file(const char *filename, PropFlags flags) {
-    LOGD("resetprop: Parse prop file [%s]\n", filename);
-    parse_prop_file(filename, [=](auto key, auto val) -> bool {
-        set_prop(key.data(), val.data(), flags);
-        return true;
-    });
+// Parse all files before changing anything, so each prop is only set once with its last value.
+// Persistent storage is updated once for the whole batch.
+static int load_files(const vector<const char *> &files, PropFlags flags) {
+    timespec start{}, end{};
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    vector<pair<string, string>> props;
+    // Position of each name in props, so later files override values in place
+    map<string, size_t> index;
+    for (const char *file : files) {
+        LOGD("resetprop: Parse prop file [%s]\n", file);
+        parse_prop_file(file, [&](string_view key, string_view val) -> bool {
+            string name(key);
+            if (!check_legal_property_name(name.data()))
+                return true;
+            if (!name.starts_with("ro.") && val.size() >= PROP_VALUE_MAX) {
+                LOGW("resetprop: value too long: [%s]\n", name.data());
+                return true;
+            }
+            if (auto it = index.find(name); it != index.end()) {
+                props[it->second].second = val;
+            } else {
+                index.emplace(name, props.size());
+                props.emplace_back(std::move(name), val);
+            }
+            return true;
+        });
+    }
+
+    int ret = 0;
+    string persist_batch;
+    for (auto &[name, val] : props) {
+        if (set_prop(name.data(), val.data(), flags, &persist_batch))
+            ret = 1;
+    }
+    if (!persist_batch.empty() && !persist_set_props(byte_view(persist_batch, false))) {
+        LOGW("resetprop: persist props error\n");
+        ret = 1;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    LOGD("resetprop: loaded %zu props from %zu files in %ldms\n", props.size(), files.size(),
+         (end.tv_sec - start.tv_sec) * 1000 + (end.tv_nsec - start.tv_nsec) / 1000000);
+    return ret;
 }
 
 struct Initialize {
@@ -317,10 +584,13 @@ stop_parse = true;           \
 
 int resetprop_main(int argc, char *argv[]) {
     PropFlags flags;
+    PrintOpts print_opts;
+    timespec wait_timeout{};
+    bool has_timeout = false;
     char *argv0 = argv[0];
     set_log_level_state(LogLevel::Debug, false);
 
-    const char *prop_file = nullptr;
+    vector<const char *> prop_files;
     const char *prop_to_rm = nullptr;
 
     --argc;
@@ -333,18 +603,46 @@ int resetprop_main(int argc, char *argv[]) {
             switch (argv[0][idx]) {
             case '-':
                 if (argv[0] == "--file"sv) {
-                    consume_next(prop_file);
+                    if (argc < 2) usage(argv0);
+                    prop_files.assign(argv + 1, argv + argc);
+                    stop_parse = true;
                 } else if (argv[0] == "--delete"sv) {
                     consume_next(prop_to_rm);
+                } else if (argv[0] == "--prefix"sv) {
+                    if (argc < 2) usage(argv0);
+                    print_opts.prefix = argv[1];
+                    --argc;
+                    ++argv;
+                } else if (argv[0] == "--regex"sv) {
+                    if (argc < 2) usage(argv0);
+                    print_opts.regex = argv[1];
+                    --argc;
+                    ++argv;
+                } else if (argv[0] == "--timeout"sv) {
+                    if (argc < 2) usage(argv0);
+                    wait_timeout.tv_sec = parse_int(argv[1]);
+                    if (wait_timeout.tv_sec < 0) usage(argv0);
+                    has_timeout = true;
+                    --argc;
+                    ++argv;
+                } else if (argv[0] == "--unsorted"sv) {
+                    print_opts.sorted = false;
+                } else if (argv[0] == "--json"sv) {
+                    print_opts.format = PrintOpts::JSON;
                 } else {
                     usage(argv0);
                 }
                 break;
+            case '0':
+                print_opts.format = PrintOpts::NUL;
+                continue;
             case 'd':
                 consume_next(prop_to_rm);
                 continue;
             case 'f':
-                consume_next(prop_file);
+                if (argc < 2) usage(argv0);
+                prop_files.assign(argv + 1, argv + argc);
+                stop_parse = true;
                 continue;
             case 'n':
                 flags.setSkipSvc();
@@ -383,14 +681,19 @@ int resetprop_main(int argc, char *argv[]) {
         return delete_prop(prop_to_rm, flags);
     }
 
-    if (prop_file) {
-        load_file(prop_file, flags);
-        return 0;
+    if (!prop_files.empty()) {
+        return load_files(prop_files, flags);
     }
 
     if (flags.isWait()) {
         if (argc == 0) usage(argv0);
-        auto val = wait_prop<string>(argv[0], argv[1]);
+        const timespec *timeout = has_timeout ? &wait_timeout : nullptr;
+        if (strchr(argv[0], '=')) {
+            vector<WaitCond> conds;
+            if (!parse_conds(argc, argv, conds)) usage(argv0);
+            return wait_conds(conds, timeout);
+        }
+        auto val = wait_prop<string>(argv[0], argv[1], timeout);
         if (val.empty())
             return 1;
         printf("%s\n", val.data());
@@ -399,8 +702,7 @@ int resetprop_main(int argc, char *argv[]) {
 
     switch (argc) {
     case 0:
-        print_props(flags);
-        return 0;
+        return print_props(flags, print_opts);
     case 1: {
         auto val = get_prop<string>(argv[0], flags);
         if (val.empty())
@@ -450,8 +752,12 @@ int set_prop(const char *name, const char *value, bool skip_svc) {
 }
 
 void load_prop_file(const char *filename, bool skip_svc) {
+    load_prop_files({ filename }, skip_svc);
+}
+
+void load_prop_files(const vector<const char *> &files, bool skip_svc) {
     InitOnce();
     PropFlags flags;
     if (skip_svc) flags.setSkipSvc();
-    load_file(filename, flags);
+    load_files(files, flags);
 }
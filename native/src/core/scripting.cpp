@@ -1,5 +1,6 @@
 #include <string>
 #include <vector>
+#include <algorithm>
 #include <sys/wait.h>
 
 #include <consts.hpp>
@@ -117,11 +118,182 @@ static bool operator>(const timespec &a, const timespec &b) {
     return a.tv_nsec > b.tv_nsec;
 }
 
+static long elapsed_ms(const timespec &from, const timespec &to) {
+    return (to.tv_sec - from.tv_sec) * 1000 + (to.tv_nsec - from.tv_nsec) / 1000000;
+}
+
+struct module_script {
+    enum { PENDING, RUNNING, DETACHED, DONE } state = PENDING;
+    const char *module;
+    string path;
+    // Indices of scripts that have to finish before this one starts
+    vector<size_t> after;
+    int pid = -1;
+    timespec start{};
+};
+
+// Read the optional "after" entry of module.prop: a comma separated list of module ids
+static void resolve_order(vector<module_script> &scripts) {
+    char buf[4096];
+    for (auto &script : scripts) {
+        ssprintf(buf, sizeof(buf), MODULEROOT "/%s/module.prop", script.module);
+        parse_prop_file(buf, [&](string_view key, string_view value) -> bool {
+            if (key != "after")
+                return true;
+            for (auto &id : split(value, ",")) {
+                for (size_t i = 0; i < scripts.size(); ++i) {
+                    if (&scripts[i] != &script && id == scripts[i].module)
+                        script.after.push_back(i);
+                }
+            }
+            return false;
+        });
+    }
+}
+
+// Run scripts concurrently up to max_running, in module order unless restricted by the
+// declared ordering. With detach set, a script that runs longer than MODULE_SCRIPT_MAX_TIME,
+// or any script still running when the stage deadline passes, is detached: it keeps running,
+// but no longer blocks the stage or the scripts ordered after it.
+static void run_module_scripts(const char *stage, vector<module_script> &scripts,
+                               size_t max_running, bool detach, const timespec *deadline) {
+    size_t running = 0;
+    size_t pending = scripts.size();
+
+    // Wait for children with sigtimedwait
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &set, nullptr);
+    timespec now{};
+
+    auto launch = [&](module_script &script) {
+        LOGI("%s: exec [%s.sh]\n", script.module, stage);
+        exec_t exec {
+            .pre_exec = set_script_env,
+        };
+        script.pid = exec_command(exec, BBEXEC_CMD, script.path.data());
+        clock_gettime(CLOCK_MONOTONIC, &script.start);
+        script.state = script.pid > 0 ? module_script::RUNNING : module_script::DONE;
+        --pending;
+        if (script.pid > 0)
+            ++running;
+    };
+
+    auto is_ready = [&](const module_script &script) {
+        return std::all_of(script.after.begin(), script.after.end(), [&](size_t i) {
+            return scripts[i].state == module_script::DETACHED ||
+                   scripts[i].state == module_script::DONE;
+        });
+    };
+
+    while (pending > 0 || running > 0) {
+        for (auto &script : scripts) {
+            if (running >= max_running)
+                break;
+            if (script.state == module_script::PENDING && is_ready(script))
+                launch(script);
+        }
+        if (running == 0 && pending > 0) {
+            // Nothing can progress, the declared ordering has a cycle
+            for (auto &script : scripts) {
+                if (script.state == module_script::PENDING) {
+                    LOGW("%s: cyclic script ordering, ignored\n", script.module);
+                    script.after.clear();
+                    break;
+                }
+            }
+            continue;
+        }
+
+        // Sleep until a child exits or the closest deadline
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if (detach) {
+            timespec wake = now;
+            wake.tv_sec += MODULE_SCRIPT_MAX_TIME;
+            for (auto &script : scripts) {
+                if (script.state == module_script::RUNNING) {
+                    timespec t = script.start;
+                    t.tv_sec += MODULE_SCRIPT_MAX_TIME;
+                    if (wake > t)
+                        wake = t;
+                }
+            }
+            if (deadline && wake > *deadline)
+                wake = *deadline;
+            if (long ms = elapsed_ms(now, wake); ms > 0) {
+                timespec timeout { .tv_sec = ms / 1000, .tv_nsec = ms % 1000 * 1000000 };
+                sigtimedwait(&set, nullptr, &timeout);
+            }
+        } else {
+            sigtimedwait(&set, nullptr, nullptr);
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        for (int pid; (pid = waitpid(-1, nullptr, WNOHANG)) > 0;) {
+            for (auto &script : scripts) {
+                if (script.pid != pid)
+                    continue;
+                long ms = elapsed_ms(script.start, now);
+                if (script.state == module_script::RUNNING) {
+                    LOGI("%s: [%s.sh] done in %ldms\n", script.module, stage, ms);
+                    --running;
+                } else {
+                    LOGI("%s: [%s.sh] detached, done in %ldms\n", script.module, stage, ms);
+                }
+                script.state = module_script::DONE;
+                script.pid = -1;
+                break;
+            }
+        }
+        for (auto &script : scripts) {
+            if (detach && script.state == module_script::RUNNING &&
+                elapsed_ms(script.start, now) >= MODULE_SCRIPT_MAX_TIME * 1000) {
+                LOGW("%s: [%s.sh] timeout, detached\n", script.module, stage);
+                script.state = module_script::DETACHED;
+                --running;
+            }
+        }
+        if (detach && deadline && !(*deadline > now)) {
+            LOGW("* %s scripts blocking phase timeout\n", stage);
+            // Start everything left without waiting for anything
+            for (auto &script : scripts) {
+                if (script.state == module_script::PENDING)
+                    launch(script);
+                if (script.state == module_script::RUNNING)
+                    script.state = module_script::DETACHED;
+            }
+            break;
+        }
+    }
+
+    // Record scripts that are still running
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    for (auto &script : scripts) {
+        if (script.state == module_script::DETACHED && script.pid > 0) {
+            LOGI("%s: [%s.sh] still running after %ldms\n", script.module, stage,
+                 elapsed_ms(script.start, now));
+        }
+    }
+}
+
 void exec_module_scripts(const char *stage, const vector<string_view> &modules) {
     LOGI("* Running module %s scripts\n", stage);
     if (modules.empty())
         return;
 
+    vector<module_script> scripts;
+    char path[4096];
+    for (auto &m : modules) {
+        const char *module = m.data();
+        ssprintf(path, sizeof(path), MODULEROOT "/%s/%s.sh", module, stage);
+        if (access(path, F_OK) == -1)
+            continue;
+        scripts.push_back({ .module = module, .path = path });
+    }
+    if (scripts.empty())
+        return;
+
     bool pfs = stage == "post-fs-data"sv;
     if (pfs) {
         timespec now{};
@@ -130,25 +302,23 @@ void exec_module_scripts(const char *stage, const vector<string_view> &modules)
         if (now > pfs_timeout)
             pfs = false;
     }
-    int timer_pid = -1;
-    PFS_SETUP()
 
-    char path[4096];
-    for (auto &m : modules) {
-        const char *module = m.data();
-        sprintf(path, MODULEROOT "/%s/%s.sh", module, stage);
-        if (access(path, F_OK) == -1)
-            continue;
-        LOGI("%s: exec [%s.sh]\n", module, stage);
-        exec_t exec {
-            .pre_exec = set_script_env,
-            .fork = pfs ? xfork : fork_dont_care
-        };
-        exec_command(exec, BBEXEC_CMD, path);
-        PFS_WAIT()
+    // Schedule in a separate process, only wait for it in post-fs-data mode
+    if (int pid = pfs ? xfork() : fork_dont_care()) {
+        if (pid > 0 && pfs)
+            waitpid(pid, nullptr, 0);
+        return;
     }
-
-    PFS_DONE()
+    resolve_order(scripts);
+    if (pfs) {
+        // Limit to the number of cores so post-fs-data scripts don't fight over the CPU
+        size_t cores = std::max(1L, sysconf(_SC_NPROCESSORS_ONLN));
+        run_module_scripts(stage, scripts, cores, true, &pfs_timeout);
+    } else {
+        // service.sh is non-blocking by design, start everything right away
+        run_module_scripts(stage, scripts, SIZE_MAX, false, nullptr);
+    }
+    exit(0);
 }
 
 constexpr char install_script[] = R"EOF(
@@ -228,6 +398,9 @@ void install_module(const char *file) {
     xdup2(fd, STDERR_FILENO);
     close(fd);
 
+    // The new module only shows up on next boot, don't let a stale mount plan hide it
+    invalidate_mount_plan();
+
     char cmds[256];
     ssprintf(cmds, sizeof(cmds), install_module_script, bbpath());
 
@@ -186,3 +186,153 @@ void write_string(int fd, string_view str) {
     write_int(fd, str.size());
     xwrite(fd, str.data(), str.size());
 }
+
+struct msg_header {
+    uint32_t len;
+    uint32_t fd_cnt;
+};
+
+msg_writer::msg_writer() : len(sizeof(msg_header)), fd_cnt(0), overflow(false) {}
+
+void msg_writer::put(const void *data, size_t sz) {
+    if (overflow || len + sz > sizeof(buf)) {
+        overflow = true;
+        return;
+    }
+    memcpy(buf + len, data, sz);
+    len += sz;
+}
+
+msg_writer &msg_writer::put_int(int val) {
+    put(&val, sizeof(val));
+    return *this;
+}
+
+msg_writer &msg_writer::put_string(string_view str) {
+    put_int(str.size());
+    put(str.data(), str.size());
+    return *this;
+}
+
+msg_writer &msg_writer::put_fd(int fd) {
+    if (fd_cnt == MSG_MAX_FDS) {
+        overflow = true;
+    } else {
+        fds[fd_cnt++] = fd;
+    }
+    return *this;
+}
+
+bool msg_writer::send(int sockfd) {
+    if (overflow) {
+        LOGE("msg: message exceeds size limit\n");
+        return false;
+    }
+    auto hdr = reinterpret_cast<msg_header *>(buf);
+    hdr->len = len - sizeof(msg_header);
+    hdr->fd_cnt = fd_cnt;
+
+    iovec iov = {
+        .iov_base = buf,
+        .iov_len  = len,
+    };
+    msghdr msg = {
+        .msg_iov        = &iov,
+        .msg_iovlen     = 1,
+    };
+
+    char cmsgbuf[CMSG_SPACE(sizeof(int) * MSG_MAX_FDS)];
+    if (fd_cnt) {
+        msg.msg_control    = cmsgbuf;
+        msg.msg_controllen = CMSG_SPACE(sizeof(int) * fd_cnt);
+        cmsghdr *cmsg    = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_len   = CMSG_LEN(sizeof(int) * fd_cnt);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type  = SCM_RIGHTS;
+        memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * fd_cnt);
+    }
+
+    return xsendmsg(sockfd, &msg, 0) == static_cast<ssize_t>(len);
+}
+
+msg_reader::msg_reader() : len(0), pos(0), fd_cnt(0), fd_pos(0) {}
+
+msg_reader::~msg_reader() {
+    close_fds();
+}
+
+void msg_reader::close_fds() {
+    for (; fd_pos < fd_cnt; ++fd_pos)
+        close(fds[fd_pos]);
+}
+
+bool msg_reader::recv(int sockfd) {
+    close_fds();
+    len = pos = 0;
+    fd_cnt = fd_pos = 0;
+
+    // Receive the header along with all fds, the payload follows with a plain read
+    msg_header hdr{};
+    iovec iov = {
+        .iov_base = &hdr,
+        .iov_len  = sizeof(hdr),
+    };
+    char cmsgbuf[CMSG_SPACE(sizeof(int) * MSG_MAX_FDS)];
+    msghdr msg = {
+        .msg_iov        = &iov,
+        .msg_iovlen     = 1,
+        .msg_control    = cmsgbuf,
+        .msg_controllen = sizeof(cmsgbuf),
+    };
+
+    if (xrecvmsg(sockfd, &msg, MSG_WAITALL | MSG_CMSG_CLOEXEC) != sizeof(hdr))
+        return false;
+
+    for (cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+            int cnt = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            memcpy(fds, CMSG_DATA(cmsg), sizeof(int) * cnt);
+            fd_cnt = cnt;
+            break;
+        }
+    }
+    if (fd_cnt != hdr.fd_cnt || (msg.msg_flags & MSG_CTRUNC)) {
+        LOGE("msg: expect %u fds, received %d\n", hdr.fd_cnt, fd_cnt);
+        return false;
+    }
+    if (hdr.len > sizeof(buf)) {
+        LOGE("msg: invalid message size %u\n", hdr.len);
+        return false;
+    }
+    if (hdr.len && xxread(sockfd, buf, hdr.len) != static_cast<ssize_t>(hdr.len))
+        return false;
+    len = hdr.len;
+    return true;
+}
+
+int msg_reader::get_int() {
+    int val;
+    if (pos + sizeof(val) > len)
+        return -1;
+    memcpy(&val, buf + pos, sizeof(val));
+    pos += sizeof(val);
+    return val;
+}
+
+string_view msg_reader::get_string() {
+    int sz = get_int();
+    if (sz < 0 || pos + sz > len)
+        return {};
+    string_view str(reinterpret_cast<const char *>(buf + pos), sz);
+    pos += sz;
+    return str;
+}
+
+int msg_reader::take_fd() {
+    return fd_pos < fd_cnt ? fds[fd_pos++] : -1;
+}
+
+void msg_reader::take_fds(vector<int> &out) {
+    out.insert(out.end(), fds + fd_pos, fds + fd_cnt);
+    fd_pos = fd_cnt;
+}
@@ -63,19 +63,20 @@ void su_info::check_db() {
     }
 
     if (eval_uid > 0) {
-        char query[256], *err;
-        ssprintf(query, sizeof(query),
+        bool ok = db_exec(
             "SELECT policy, logging, notification FROM policies "
-            "WHERE uid=%d AND (until=0 OR until>%li)", eval_uid, time(nullptr));
-        err = db_exec(query, [&](db_row &row) -> bool {
-            access.policy = (policy_t) parse_int(row["policy"]);
-            access.log = parse_int(row["logging"]);
-            access.notify = parse_int(row["notification"]);
-            LOGD("magiskdb: query policy=[%d] log=[%d] notify=[%d]\n",
-                 access.policy, access.log, access.notify);
-            return true;
-        });
-        db_err_cmd(err, return);
+            "WHERE uid=? AND (until=0 OR until>?)",
+            { eval_uid, time(nullptr) },
+            [&](const db_values &v) -> bool {
+                access.policy = (policy_t) v.get_int(0);
+                access.log = v.get_int(1);
+                access.notify = v.get_int(2);
+                LOGD("magiskdb: query policy=[%d] log=[%d] notify=[%d]\n",
+                     access.policy, access.log, access.notify);
+                return true;
+            });
+        if (!ok)
+            return;
     }
 
     // We need to check our manager
@@ -124,15 +125,15 @@ bool uid_granted_root(int uid) {
 
     bool granted = false;
 
-    char query[256], *err;
-    ssprintf(query, sizeof(query),
-        "SELECT policy FROM policies WHERE uid=%d AND (until=0 OR until>%li)",
-        uid, time(nullptr));
-    err = db_exec(query, [&](db_row &row) -> bool {
-        granted = parse_int(row["policy"]) == ALLOW;
-        return true;
-    });
-    db_err_cmd(err, return false);
+    bool ok = db_exec(
+        "SELECT policy FROM policies WHERE uid=? AND (until=0 OR until>?)",
+        { uid, time(nullptr) },
+        [&](const db_values &v) -> bool {
+            granted = v.get_int(0) == ALLOW;
+            return true;
+        });
+    if (!ok)
+        return false;
 
     return granted;
 }
@@ -141,10 +142,8 @@ void prune_su_access() {
     cached.reset();
     vector<bool> app_no_list = get_app_no_list();
     vector<int> rm_uids;
-    char query[256], *err;
-    strscpy(query, "SELECT uid FROM policies", sizeof(query));
-    err = db_exec(query, [&](db_row &row) -> bool {
-        int uid = parse_int(row["uid"]);
+    bool ok = db_exec("SELECT uid FROM policies", {}, [&](const db_values &v) -> bool {
+        int uid = v.get_int(0);
         int app_id = to_app_id(uid);
         if (app_id >= AID_APP_START && app_id <= AID_APP_END) {
             int app_no = app_id - AID_APP_START;
@@ -155,12 +154,12 @@ void prune_su_access() {
         }
         return true;
     });
-    db_err_cmd(err, return);
+    if (!ok)
+        return;
 
     for (int uid : rm_uids) {
-        ssprintf(query, sizeof(query), "DELETE FROM policies WHERE uid == %d", uid);
         // Don't care about errors
-        db_exec(query);
+        db_exec("DELETE FROM policies WHERE uid=?", { uid });
     }
 }
 
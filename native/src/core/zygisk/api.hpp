@@ -197,6 +197,15 @@ enum Option : int {
     // Be aware that after dlclose-ing your module, all of your code will be unmapped from memory.
     // YOU MUST NOT ENABLE THIS OPTION AFTER HOOKING ANY FUNCTIONS IN THE PROCESS.
     DLCLOSE_MODULE_LIBRARY = 1,
+
+    // When this option is set in onLoad, your module's library will be loaded in zygote and
+    // shared by all processes forked afterwards. Relocation and onLoad will only run once in
+    // zygote instead of in every process, and states set up in onLoad will be inherited.
+    // Only the pre/post[XXX]Specialize callbacks will run in each process.
+    // The option takes effect starting from the next process fork.
+    // YOUR onLoad WILL RUN IN ZYGOTE: DO NOT HOOK ANY FUNCTIONS, START ANY THREADS, OR KEEP ANY
+    // FILE DESCRIPTORS OPEN IN onLoad IF YOU ENABLE THIS OPTION.
+    SHARE_MODULE_LIBRARY = 2,
 };
 
 // Bit masks of the return value of Api::getFlags()
@@ -2,6 +2,8 @@
 #include <dlfcn.h>
 #include <sys/prctl.h>
 #include <sys/mount.h>
+#include <sys/syscall.h>
+#include <poll.h>
 #include <android/log.h>
 #include <android/dlext.h>
 
@@ -30,41 +32,66 @@ extern "C" [[maybe_unused]] NativeBridgeCallbacks NativeBridgeItf{
 
 // The following code runs in zygote/app process
 
-static inline bool should_load_modules(uint32_t flags) {
-    return (flags & UNMOUNT_MASK) != UNMOUNT_MASK &&
-           (flags & PROCESS_IS_MAGISK_APP) != PROCESS_IS_MAGISK_APP;
-}
-
 int remote_get_info(int uid, const char *process, uint32_t *flags, vector<int> &fds) {
     if (int fd = zygisk_request(ZygiskRequest::GET_INFO); fd >= 0) {
-        write_int(fd, uid);
-        write_string(fd, process);
-        xxread(fd, flags, sizeof(*flags));
-        if (should_load_modules(*flags)) {
-            fds = recv_fds(fd);
+        msg_writer req;
+        req.put_int(uid).put_string(process);
+        msg_reader res;
+        if (req.send(fd) && res.recv(fd)) {
+            *flags = res.get_int();
+            res.take_fds(fds);
+            return fd;
         }
-        return fd;
+        close(fd);
     }
     return -1;
 }
 
+vector<module_bundle_entry> read_module_bundle(int fd) {
+    vector<module_bundle_entry> table;
+    struct stat st{};
+    uint32_t cnt = 0;
+    if (fstat(fd, &st) != 0 || pread(fd, &cnt, sizeof(cnt), 0) != sizeof(cnt))
+        return table;
+    auto file_sz = static_cast<uint64_t>(st.st_size);
+    if (cnt > file_sz / sizeof(module_bundle_entry))
+        return table;
+    size_t sz = cnt * sizeof(module_bundle_entry);
+    table.resize(cnt);
+    if (pread(fd, table.data(), sz, sizeof(cnt)) != static_cast<ssize_t>(sz)) {
+        table.clear();
+        return table;
+    }
+    for (auto &e : table) {
+        // Ignore any library that cannot be loaded from the bundle
+        if (e.offset % MODULE_BUNDLE_ALIGN != 0 || (uint64_t) e.offset + e.size > file_sz)
+            e.size = 0;
+    }
+    return table;
+}
+
+void *dlopen_module(int fd, const module_bundle_entry &e) {
+    if (e.size == 0)
+        return nullptr;
+    android_dlextinfo info {
+        .flags = ANDROID_DLEXT_USE_LIBRARY_FD | ANDROID_DLEXT_USE_LIBRARY_FD_OFFSET,
+        .library_fd = fd,
+        .library_fd_offset = e.offset,
+    };
+    return android_dlopen_ext("/jit-cache", RTLD_LAZY, &info);
+}
+
 // The following code runs in magiskd
 
-static vector<int> get_module_fds(bool is_64_bit) {
-    vector<int> fds;
-    // All fds passed to send_fds have to be valid file descriptors.
-    // To workaround this issue, send over STDOUT_FILENO as an indicator of an
-    // invalid fd as it will always be /dev/null in magiskd
-    if (is_64_bit) {
+static int get_module_bundle(bool is_64_bit) {
 #if defined(__LP64__)
-        std::transform(module_list->begin(), module_list->end(), std::back_inserter(fds),
-            [](const module_info &info) { return info.z64 < 0 ? STDOUT_FILENO : info.z64; });
+    if (is_64_bit)
+        return module_bundle64;
+#else
+    if (is_64_bit)
+        return -1;
 #endif
-    } else {
-        std::transform(module_list->begin(), module_list->end(), std::back_inserter(fds),
-            [](const module_info &info) { return info.z32 < 0 ? STDOUT_FILENO : info.z32; });
-    }
-    return fds;
+    return module_bundle32;
 }
 
 static bool get_exe(int pid, char *buf, size_t sz) {
@@ -106,8 +133,7 @@ static void connect_companion(int client, bool is_64_bit) {
             exit(-1);
         }
         close(fds[1]);
-        vector<int> module_fds = get_module_fds(is_64_bit);
-        send_fds(zygiskd_socket, module_fds.data(), module_fds.size());
+        send_fd(zygiskd_socket, get_module_bundle(is_64_bit));
         // Wait for ack
         if (read_int(zygiskd_socket) != 0) {
             LOGE("zygiskd startup error\n");
@@ -117,10 +143,68 @@ static void connect_companion(int client, bool is_64_bit) {
     send_fd(zygiskd_socket, client);
 }
 
+static pthread_mutex_t unmount_lock = PTHREAD_MUTEX_INITIALIZER;
+// The mount namespace the cached unmount targets are computed for
+static struct stat unmount_ns;
+// Polls with POLLPRI once the mount table of that namespace changes
+static int mountinfo_fd = -1;
+// -1 with a valid cache means there is nothing to unmount
+static int unmount_fd = -1;
+
+static void reset_unmount_cache() {
+    close(unmount_fd);
+    close(mountinfo_fd);
+    unmount_fd = -1;
+    mountinfo_fd = -1;
+}
+
+// All denylisted apps share the same mount namespace as zygote before unsharing,
+// so compute the unmount targets once and hand them to every child through a sealed memfd.
+// The targets are recomputed whenever anything is mounted or unmounted in that namespace.
+static int get_unmount_fd(int pid) {
+    char buf[32];
+    struct stat ns{};
+    ssprintf(buf, sizeof(buf), "/proc/%d/ns/mnt", pid);
+    if (stat(buf, &ns) != 0)
+        return -1;
+
+    mutex_guard g(unmount_lock);
+    bool stale = mountinfo_fd < 0 || ns.st_dev != unmount_ns.st_dev || ns.st_ino != unmount_ns.st_ino;
+    if (!stale) {
+        pollfd pfd = { mountinfo_fd, POLLPRI, 0 };
+        stale = poll(&pfd, 1, 0) != 0;
+    }
+    if (stale) {
+        reset_unmount_cache();
+        // Open before collecting targets so changes in between are not missed
+        ssprintf(buf, sizeof(buf), "/proc/%d/mountinfo", pid);
+        mountinfo_fd = open(buf, O_RDONLY | O_CLOEXEC);
+        if (mountinfo_fd < 0)
+            return -1;
+        unmount_ns = ns;
+        ssprintf(buf, sizeof(buf), "%d", pid);
+        string targets = get_unmount_targets(buf);
+        if (!targets.empty()) {
+            int fd = syscall(__NR_memfd_create, "unmount", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+            if (fd < 0) {
+                reset_unmount_cache();
+                return -1;
+            }
+            xwrite(fd, targets.data(), targets.size());
+            fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL);
+            unmount_fd = fd;
+        }
+    }
+    return unmount_fd < 0 ? -1 : fcntl(unmount_fd, F_DUPFD_CLOEXEC, 0);
+}
+
 extern bool uid_granted_root(int uid);
 static void get_process_info(int client, const sock_cred *cred) {
-    int uid = read_int(client);
-    string process = read_string(client);
+    msg_reader req;
+    if (!req.recv(client))
+        return;
+    int uid = req.get_int();
+    string_view process = req.get_string();
 
     uint32_t flags = 0;
 
@@ -139,18 +223,25 @@ static void get_process_info(int client, const sock_cred *cred) {
         flags |= PROCESS_GRANTED_ROOT;
     }
 
-    xwrite(client, &flags, sizeof(flags));
-
-    if (should_load_modules(flags)) {
+    // Reply flags and module fds in a single message
+    msg_writer res;
+    res.put_int(static_cast<int>(flags));
+    owned_fd unmount;
+    if ((flags & UNMOUNT_MASK) == UNMOUNT_MASK) {
+        unmount = get_unmount_fd(cred->pid);
+        if (unmount >= 0)
+            res.put_fd(unmount);
+    } else if (should_load_modules(flags)) {
         char buf[256];
         if (!get_exe(cred->pid, buf, sizeof(buf))) {
             LOGW("zygisk: remote process %d probably died, abort\n", cred->pid);
-            send_fd(client, -1);
+            res.send(client);
             return;
         }
-        vector<int> fds = get_module_fds(str_ends(buf, "64"));
-        send_fds(client, fds.data(), fds.size());
+        if (int fd = get_module_bundle(str_ends(buf, "64")); fd >= 0)
+            res.put_fd(fd);
     }
+    res.send(client);
 
     if (uid != 1000 || process != "system_server")
         return;
@@ -177,6 +268,18 @@ static void get_process_info(int client, const sock_cred *cred) {
     }
 }
 
+static void get_modules(int client, const sock_cred *cred) {
+    char buf[256];
+    if (!get_exe(cred->pid, buf, sizeof(buf))) {
+        LOGW("zygisk: remote process %d probably died, abort\n", cred->pid);
+        return;
+    }
+    msg_writer res;
+    if (int fd = get_module_bundle(str_ends(buf, "64")); fd >= 0)
+        res.put_fd(fd);
+    res.send(client);
+}
+
 static void get_moddir(int client) {
     int id = read_int(client);
     char buf[4096];
@@ -203,6 +306,9 @@ void zygisk_handler(int client, const sock_cred *cred) {
     case ZygiskRequest::GET_MODDIR:
         get_moddir(client);
         break;
+    case ZygiskRequest::GET_MODULES:
+        get_modules(client, cred);
+        break;
     default:
         // Unknown code
         break;
@@ -217,6 +323,9 @@ void reset_zygisk(bool restore) {
         close(zygiskd_sockets[0]);
         close(zygiskd_sockets[1]);
         zygiskd_sockets[0] = zygiskd_sockets[1] = -1;
+
+        mutex_guard g(unmount_lock);
+        reset_unmount_cache();
     }
     if (restore) {
         zygote_start_count = 1;
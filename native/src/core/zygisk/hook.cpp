@@ -1,5 +1,6 @@
 #include <sys/mount.h>
 #include <dlfcn.h>
+#include <link.h>
 #include <unwind.h>
 
 #include <lsplt.hpp>
@@ -101,6 +102,8 @@ struct HookContext {
     JNINativeInterface new_env{};
     const JNINativeInterface *old_env = nullptr;
     const NativeBridgeRuntimeCallbacks *runtime_callbacks = nullptr;
+    MapSnapshot map_cache;
+    unsigned long long map_gen = 0;
 
     void hook_plt();
     void hook_unloader();
@@ -110,7 +113,8 @@ struct HookContext {
     void post_native_bridge_load();
 
 private:
-    void register_hook(dev_t dev, ino_t inode, const char *symbol, void *new_func, void **old_func);
+    void register_hook(const MapSnapshot &maps, const char *lib, const char *symbol,
+                       void *new_func, void **old_func);
 };
 
 // Global contexts:
@@ -128,6 +132,47 @@ static void *self_handle = nullptr;
 
 // -----------------------------------------------------------------
 
+const lsplt::MapInfo *MapSnapshot::find(string_view name) const {
+    auto it = by_name.find(name);
+    return it == by_name.end() ? nullptr : it->second;
+}
+
+// The linker bumps dlpi_adds/dlpi_subs every time a library is loaded or unloaded.
+// These fields only exist on Android 11+, return 0 if they are not available,
+// in which case every hooking phase has to scan /proc/self/maps again.
+static unsigned long long dl_generation() {
+    unsigned long long gen = 0;
+    dl_iterate_phdr(+[](dl_phdr_info *info, size_t size, void *arg) -> int {
+        if (size >= offsetof(dl_phdr_info, dlpi_subs) + sizeof(info->dlpi_subs)) {
+            // Both counters only grow, so their sum changes on every load and unload
+            *static_cast<unsigned long long *>(arg) = info->dlpi_adds + info->dlpi_subs;
+        }
+        return 1;
+    }, &gen);
+    return gen;
+}
+
+const MapSnapshot &get_maps() {
+    auto &cache = g_hook->map_cache;
+    auto gen = dl_generation();
+    if (gen != 0 && gen == g_hook->map_gen)
+        return cache;
+
+    cache.by_name.clear();
+    cache.maps = lsplt::MapInfo::Scan();
+    for (const auto &map : cache.maps) {
+        if (map.offset != 0 || map.path.empty() || map.path[0] != '/')
+            continue;
+        string_view name = map.path;
+        name.remove_prefix(name.rfind('/') + 1);
+        cache.by_name.emplace(name, &map);
+    }
+    g_hook->map_gen = gen;
+    return cache;
+}
+
+// -----------------------------------------------------------------
+
 #define DCL_HOOK_FUNC(ret, func, ...) \
 ret (*old_##func)(__VA_ARGS__);       \
 ret new_##func(__VA_ARGS__)
@@ -148,7 +193,11 @@ DCL_HOOK_FUNC(static int, unshare, int flags) {
     int res = old_unshare(flags);
     if (g_ctx && (flags & CLONE_NEWNS) != 0 && res == 0) {
         if (g_ctx->flags & DO_REVERT_UNMOUNT) {
-            revert_unmount();
+            if (g_ctx->unmount_targets.empty()) {
+                revert_unmount();
+            } else {
+                revert_unmount(g_ctx->unmount_targets);
+            }
         }
         // Restore errno back to 0
         errno = 0;
@@ -229,6 +278,11 @@ ZygiskContext::~ZygiskContext() {
     if (!is_child())
         return;
 
+    if (!unmount_targets.empty()) {
+        munmap((void *) unmount_targets.data(), unmount_targets.size());
+    }
+    release_zygote_modules();
+
     zygisk_close_logd();
     android_logging();
 
@@ -270,7 +324,7 @@ inline void *unwind_get_region_start(_Unwind_Context *ctx) {
 static const NativeBridgeRuntimeCallbacks* find_runtime_callbacks(struct _Unwind_Context *ctx) {
     // Find the writable memory region of libart.so, where the NativeBridgeRuntimeCallbacks is located.
     auto [start, end] = []()-> tuple<uintptr_t, uintptr_t> {
-        for (const auto &map : lsplt::MapInfo::Scan()) {
+        for (const auto &map : get_maps().maps) {
             if (map.path.ends_with("/libart.so") && map.perms == (PROT_WRITE | PROT_READ)) {
                 ZLOGV("libart.so: start=%p, end=%p\n",
                       reinterpret_cast<void *>(map.start), reinterpret_cast<void *>(map.end));
@@ -357,44 +411,31 @@ void HookContext::post_native_bridge_load() {
 
 // -----------------------------------------------------------------
 
-void HookContext::register_hook(
-        dev_t dev, ino_t inode, const char *symbol, void *new_func, void **old_func) {
-    if (!lsplt::RegisterHook(dev, inode, symbol, new_func, old_func)) {
+void HookContext::register_hook(const MapSnapshot &maps, const char *lib, const char *symbol,
+                                void *new_func, void **old_func) {
+    auto map = maps.find(lib);
+    if (map == nullptr || !lsplt::RegisterHook(map->dev, map->inode, symbol, new_func, old_func)) {
         ZLOGE("Failed to register plt_hook \"%s\"\n", symbol);
         return;
     }
-    plt_backup.emplace_back(dev, inode, symbol, old_func);
+    plt_backup.emplace_back(map->dev, map->inode, symbol, old_func);
 }
 
-#define PLT_HOOK_REGISTER_SYM(DEV, INODE, SYM, NAME) \
-    register_hook(DEV, INODE, SYM, \
+#define PLT_HOOK_REGISTER_SYM(LIB, SYM, NAME) \
+    register_hook(maps, LIB, SYM, \
     reinterpret_cast<void *>(new_##NAME), reinterpret_cast<void **>(&old_##NAME))
 
-#define PLT_HOOK_REGISTER(DEV, INODE, NAME) \
-    PLT_HOOK_REGISTER_SYM(DEV, INODE, #NAME, NAME)
+#define PLT_HOOK_REGISTER(LIB, NAME) \
+    PLT_HOOK_REGISTER_SYM(LIB, #NAME, NAME)
 
 void HookContext::hook_plt() {
-    ino_t android_runtime_inode = 0;
-    dev_t android_runtime_dev = 0;
-    ino_t native_bridge_inode = 0;
-    dev_t native_bridge_dev = 0;
-
-    for (auto &map : lsplt::MapInfo::Scan()) {
-        if (map.path.ends_with("/libandroid_runtime.so")) {
-            android_runtime_inode = map.inode;
-            android_runtime_dev = map.dev;
-        } else if (map.path.ends_with("/libnativebridge.so")) {
-            native_bridge_inode = map.inode;
-            native_bridge_dev = map.dev;
-        }
-    }
-
-    PLT_HOOK_REGISTER(native_bridge_dev, native_bridge_inode, dlclose);
-    PLT_HOOK_REGISTER(android_runtime_dev, android_runtime_inode, fork);
-    PLT_HOOK_REGISTER(android_runtime_dev, android_runtime_inode, unshare);
-    PLT_HOOK_REGISTER(android_runtime_dev, android_runtime_inode, androidSetCreateThreadFunc);
-    PLT_HOOK_REGISTER(android_runtime_dev, android_runtime_inode, selinux_android_setcontext);
-    PLT_HOOK_REGISTER_SYM(android_runtime_dev, android_runtime_inode, "__android_log_close", android_log_close);
+    auto &maps = get_maps();
+    PLT_HOOK_REGISTER("libnativebridge.so", dlclose);
+    PLT_HOOK_REGISTER("libandroid_runtime.so", fork);
+    PLT_HOOK_REGISTER("libandroid_runtime.so", unshare);
+    PLT_HOOK_REGISTER("libandroid_runtime.so", androidSetCreateThreadFunc);
+    PLT_HOOK_REGISTER("libandroid_runtime.so", selinux_android_setcontext);
+    PLT_HOOK_REGISTER_SYM("libandroid_runtime.so", "__android_log_close", android_log_close);
 
     if (!lsplt::CommitHook())
         ZLOGE("plt_hook failed\n");
@@ -407,18 +448,8 @@ void HookContext::hook_plt() {
 }
 
 void HookContext::hook_unloader() {
-    ino_t art_inode = 0;
-    dev_t art_dev = 0;
-
-    for (auto &map : lsplt::MapInfo::Scan()) {
-        if (map.path.ends_with("/libart.so")) {
-            art_inode = map.inode;
-            art_dev = map.dev;
-            break;
-        }
-    }
-
-    PLT_HOOK_REGISTER(art_dev, art_inode, pthread_attr_destroy);
+    auto &maps = get_maps();
+    PLT_HOOK_REGISTER("libart.so", pthread_attr_destroy);
     if (!lsplt::CommitHook())
         ZLOGE("plt_hook failed\n");
 }
@@ -497,16 +528,13 @@ void HookContext::hook_jni_env() {
     auto get_created_vms = reinterpret_cast<method_sig>(
             dlsym(RTLD_DEFAULT, "JNI_GetCreatedJavaVMs"));
     if (!get_created_vms) {
-        for (auto &map: lsplt::MapInfo::Scan()) {
-            if (!map.path.ends_with("/libnativehelper.so")) continue;
-            void *h = dlopen(map.path.data(), RTLD_LAZY);
-            if (!h) {
+        if (auto map = get_maps().find("libnativehelper.so")) {
+            if (void *h = dlopen(map->path.data(), RTLD_LAZY)) {
+                get_created_vms = reinterpret_cast<method_sig>(dlsym(h, "JNI_GetCreatedJavaVMs"));
+                dlclose(h);
+            } else {
                 ZLOGW("Cannot dlopen libnativehelper.so: %s\n", dlerror());
-                break;
             }
-            get_created_vms = reinterpret_cast<method_sig>(dlsym(h, "JNI_GetCreatedJavaVMs"));
-            dlclose(h);
-            break;
         }
         if (!get_created_vms) {
             ZLOGW("JNI_GetCreatedJavaVMs not found\n");
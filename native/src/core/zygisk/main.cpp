@@ -1,5 +1,4 @@
 #include <sys/mount.h>
-#include <android/dlext.h>
 #include <dlfcn.h>
 
 #include <consts.hpp>
@@ -29,24 +28,17 @@ static void zygiskd(int socket) {
     using comp_entry = void(*)(int);
     vector<comp_entry> modules;
     {
-        vector<int> module_fds = recv_fds(socket);
-        for (int fd : module_fds) {
+        int bundle = recv_fd(socket);
+        for (const auto &e : read_module_bundle(bundle)) {
             comp_entry entry = nullptr;
-            struct stat s{};
-            if (fstat(fd, &s) == 0 && S_ISREG(s.st_mode)) {
-                android_dlextinfo info {
-                    .flags = ANDROID_DLEXT_USE_LIBRARY_FD,
-                    .library_fd = fd,
-                };
-                if (void *h = android_dlopen_ext("/jit-cache", RTLD_LAZY, &info)) {
-                    *(void **) &entry = dlsym(h, "zygisk_companion_entry");
-                } else {
-                    LOGW("Failed to dlopen zygisk module: %s\n", dlerror());
-                }
+            if (void *h = dlopen_module(bundle, e)) {
+                *(void **) &entry = dlsym(h, "zygisk_companion_entry");
+            } else if (e.size) {
+                LOGW("Failed to dlopen zygisk module: %s\n", dlerror());
             }
             modules.push_back(entry);
-            close(fd);
         }
+        close(bundle);
     }
 
     // ack
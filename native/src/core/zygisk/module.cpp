@@ -1,5 +1,6 @@
-#include <android/dlext.h>
+#include <sys/syscall.h>
 #include <dlfcn.h>
+#include <poll.h>
 
 #include <lsplt.hpp>
 
@@ -103,6 +104,9 @@ void ZygiskModule::setOption(zygisk::Option opt) {
         case zygisk::DLCLOSE_MODULE_LIBRARY:
             unload = true;
             break;
+        case zygisk::SHARE_MODULE_LIBRARY:
+            share = true;
+            break;
     }
 }
 
@@ -114,6 +118,10 @@ void ZygiskModule::tryUnload() const {
     if (unload) dlclose(handle);
 }
 
+void ZygiskModule::forceUnload() const {
+    dlclose(handle);
+}
+
 // -----------------------------------------------------------------
 
 #define call_app(method)               \
@@ -171,7 +179,7 @@ void ZygiskContext::plt_hook_exclude(const char *regex, const char *symbol) {
 void ZygiskContext::plt_hook_process_regex() {
     if (register_info.empty())
         return;
-    for (auto &map : lsplt::MapInfo::Scan()) {
+    for (auto &map : get_maps().maps) {
         if (map.offset != 0 || !map.is_private || !(map.perms & PROT_READ)) continue;
         for (auto &reg: register_info) {
             if (regexec(&reg.regex, map.path.data(), 0, nullptr, 0) != 0)
@@ -204,6 +212,45 @@ bool ZygiskContext::plt_hook_commit() {
 
 // -----------------------------------------------------------------
 
+#ifndef __NR_close_range
+#define __NR_close_range 436
+#endif
+
+static int close_fd_range(unsigned first, unsigned last) {
+    return syscall(__NR_close_range, first, last, 0);
+}
+
+// Record all open fds below MAX_FD_SIZE and close everything above.
+// poll(2) reports POLLNVAL for every fd that is not open, so a single syscall is enough
+// to probe the whole range. Fallback to iterating procfs if close_range is not supported.
+static void scan_fds(bitset<MAX_FD_SIZE> &fds) {
+    pollfd pfds[MAX_FD_SIZE];
+    for (int i = 0; i < MAX_FD_SIZE; ++i) {
+        pfds[i] = { .fd = i, .events = 0, .revents = 0 };
+    }
+    fds.reset();
+    if (poll(pfds, MAX_FD_SIZE, 0) >= 0 && close_fd_range(MAX_FD_SIZE, ~0U) == 0) {
+        for (int i = 0; i < MAX_FD_SIZE; ++i) {
+            if (!(pfds[i].revents & POLLNVAL))
+                fds[i] = true;
+        }
+        return;
+    }
+
+    auto dir = xopen_dir("/proc/self/fd");
+    int dfd = dirfd(dir.get());
+    for (dirent *entry; (entry = xreaddir(dir.get()));) {
+        int fd = parse_int(entry->d_name);
+        if (fd < 0 || fd == dfd)
+            continue;
+        if (fd >= MAX_FD_SIZE) {
+            close(fd);
+            continue;
+        }
+        fds[fd] = true;
+    }
+}
+
 void ZygiskContext::sanitize_fds() {
     zygisk_close_logd();
 
@@ -229,31 +276,34 @@ void ZygiskContext::sanitize_fds() {
         };
 
         if (jintArray fdsToIgnore = *args.app->fds_to_ignore) {
-            int *arr = env->GetIntArrayElements(fdsToIgnore, nullptr);
+            // The original fds were opened before fork, so they are already allowed
             int len = env->GetArrayLength(fdsToIgnore);
-            for (int i = 0; i < len; ++i) {
-                int fd = arr[i];
-                if (fd >= 0 && fd < MAX_FD_SIZE) {
-                    allowed_fds[fd] = true;
-                }
-            }
             if (jintArray newFdList = update_fd_array(len)) {
+                int *arr = env->GetIntArrayElements(fdsToIgnore, nullptr);
                 env->SetIntArrayRegion(newFdList, 0, len, arr);
+                env->ReleaseIntArrayElements(fdsToIgnore, arr, JNI_ABORT);
             }
-            env->ReleaseIntArrayElements(fdsToIgnore, arr, JNI_ABORT);
         } else {
             update_fd_array(0);
         }
     }
 
     // Close all forbidden fds to prevent crashing
-    auto dir = xopen_dir("/proc/self/fd");
-    int dfd = dirfd(dir.get());
-    for (dirent *entry; (entry = xreaddir(dir.get()));) {
-        int fd = parse_int(entry->d_name);
-        if ((fd < 0 || fd >= MAX_FD_SIZE || !allowed_fds[fd]) && fd != dfd) {
-            close(fd);
+    bitset<MAX_FD_SIZE> fds;
+    scan_fds(fds);
+    fds &= ~allowed_fds;
+    for (int fd = 0; fd < MAX_FD_SIZE; ++fd) {
+        if (!fds[fd])
+            continue;
+        // Close consecutive fds in one go
+        int last = fd;
+        while (last + 1 < MAX_FD_SIZE && fds[last + 1])
+            ++last;
+        if (last == fd || close_fd_range(fd, last) != 0) {
+            for (int i = fd; i <= last; ++i)
+                close(i);
         }
+        fd = last;
     }
 }
 
@@ -287,17 +337,7 @@ void ZygiskContext::fork_pre() {
         return;
 
     // Record all open fds
-    auto dir = xopen_dir("/proc/self/fd");
-    for (dirent *entry; (entry = xreaddir(dir.get()));) {
-        int fd = parse_int(entry->d_name);
-        if (fd < 0 || fd >= MAX_FD_SIZE) {
-            close(fd);
-            continue;
-        }
-        allowed_fds[fd] = true;
-    }
-    // The dirfd will be closed once out of scope
-    allowed_fds[dirfd(dir.get())] = false;
+    scan_fds(allowed_fds);
     // logd_fd should be handled separately
     if (int fd = zygisk_get_logd(); fd >= 0) {
         allowed_fds[fd] = false;
@@ -309,36 +349,119 @@ void ZygiskContext::fork_post() {
     sigmask(SIG_UNBLOCK, SIGCHLD);
 }
 
-void ZygiskContext::run_modules_pre(const vector<int> &fds) {
-    for (int i = 0; i < fds.size(); ++i) {
-        struct stat s{};
-        if (fstat(fds[i], &s) != 0 || !S_ISREG(s.st_mode)) {
-            close(fds[i]);
+// Modules that set SHARE_MODULE_LIBRARY are loaded in zygote, and forked processes
+// inherit both the relocated library and all states set up in onLoad.
+// Children report such requests back to zygote through a MAP_SHARED page.
+#define SHARE_REQ_SIZE 4096
+enum : uint8_t {
+    SHARE_NONE,
+    SHARE_REQUESTED,
+    SHARE_HANDLED,
+};
+static uint8_t *share_req = nullptr;
+static list<ZygiskModule> *zygote_modules = nullptr;
+
+void ZygiskContext::load_zygote_modules() {
+    if (share_req == nullptr) {
+        void *addr = mmap(nullptr, SHARE_REQ_SIZE, PROT_READ | PROT_WRITE,
+                          MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        if (addr != MAP_FAILED)
+            share_req = static_cast<uint8_t *>(addr);
+        return;
+    }
+    if (memchr(share_req, SHARE_REQUESTED, SHARE_REQ_SIZE) == nullptr)
+        return;
+
+    int bundle = -1;
+    if (int fd = zygisk_request(ZygiskRequest::GET_MODULES); fd >= 0) {
+        msg_reader res;
+        if (res.recv(fd))
+            bundle = res.take_fd();
+        close(fd);
+    }
+    if (bundle < 0)
+        return;
+
+    if (zygote_modules == nullptr)
+        default_new(zygote_modules);
+    // Module code should not be able to change the state of this context
+    auto saved_flags = flags;
+    auto table = read_module_bundle(bundle);
+    for (int i = 0; i < table.size() && i < SHARE_REQ_SIZE; ++i) {
+        if (share_req[i] != SHARE_REQUESTED)
             continue;
+        // Never retry, even if loading fails
+        share_req[i] = SHARE_HANDLED;
+        if (void *h = dlopen_module(bundle, table[i])) {
+            if (void *e = dlsym(h, "zygisk_module_entry")) {
+                auto &m = zygote_modules->emplace_back(i, h, e);
+                m.onLoad(env);
+                if (m.valid()) {
+                    ZLOGI("module [%d] is loaded in zygote\n", i);
+                } else {
+                    zygote_modules->pop_back();
+                }
+            }
         }
-        android_dlextinfo info {
-            .flags = ANDROID_DLEXT_USE_LIBRARY_FD,
-            .library_fd = fds[i],
-        };
-        if (void *h = android_dlopen_ext("/jit-cache", RTLD_LAZY, &info)) {
+    }
+    close(bundle);
+    flags = saved_flags;
+}
+
+void release_zygote_modules() {
+    // Modules that are not used in this process should not stay in memory
+    if (zygote_modules) {
+        for (const auto &m : *zygote_modules)
+            m.forceUnload();
+        delete zygote_modules;
+        zygote_modules = nullptr;
+    }
+    if (share_req) {
+        munmap(share_req, SHARE_REQ_SIZE);
+        share_req = nullptr;
+    }
+}
+
+void ZygiskContext::run_modules_pre(int bundle) {
+    // Modules already loaded in zygote
+    dynamic_bitset shared;
+    if (zygote_modules && should_load_modules(info_flags)) {
+        for (const auto &m : *zygote_modules)
+            shared[m.getId()] = true;
+    }
+
+    auto table = read_module_bundle(bundle);
+    for (int i = 0; i < table.size(); ++i) {
+        if (as_const(shared)[i] || table[i].size == 0)
+            continue;
+        if (void *h = dlopen_module(bundle, table[i])) {
             if (void *e = dlsym(h, "zygisk_module_entry")) {
                 modules.emplace_back(i, h, e);
             }
         } else if (flags & SERVER_FORK_AND_SPECIALIZE) {
             ZLOGW("Failed to dlopen zygisk module: %s\n", dlerror());
         }
-        close(fds[i]);
     }
+    close(bundle);
 
     for (auto it = modules.begin(); it != modules.end();) {
         it->onLoad(env);
         if (it->valid()) {
+            if (it->shared() && share_req && it->getId() < SHARE_REQ_SIZE &&
+                share_req[it->getId()] == SHARE_NONE) {
+                share_req[it->getId()] = SHARE_REQUESTED;
+            }
             ++it;
         } else {
             it = modules.erase(it);
         }
     }
 
+    // Splicing does not move the modules, so the API tables they hold stay valid
+    if (zygote_modules && should_load_modules(info_flags)) {
+        modules.splice(modules.begin(), *zygote_modules);
+    }
+
     for (auto &m : modules) {
         if (flags & APP_SPECIALIZE) {
             m.preAppSpecialize(args.app);
@@ -368,8 +491,19 @@ void ZygiskContext::app_specialize_pre() {
     if ((info_flags & UNMOUNT_MASK) == UNMOUNT_MASK) {
         ZLOGI("[%s] is on the denylist\n", process);
         flags |= DO_REVERT_UNMOUNT;
+        // magiskd sends over the precomputed unmount targets, map it before fds are sanitized
+        if (!module_fds.empty()) {
+            int ufd = module_fds[0];
+            struct stat st{};
+            if (fstat(ufd, &st) == 0 && st.st_size > 0) {
+                void *addr = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, ufd, 0);
+                if (addr != MAP_FAILED)
+                    unmount_targets = string_view(static_cast<char *>(addr), st.st_size);
+            }
+            close(ufd);
+        }
     } else if (fd >= 0) {
-        run_modules_pre(module_fds);
+        run_modules_pre(module_fds.empty() ? -1 : module_fds[0]);
     }
     close(fd);
 }
@@ -391,7 +525,7 @@ void ZygiskContext::server_specialize_pre() {
         if (module_fds.empty()) {
             write_int(fd, 0);
         } else {
-            run_modules_pre(module_fds);
+            run_modules_pre(module_fds[0]);
 
             // Send the bitset of module status back to magiskd from system_server
             dynamic_bitset bits;
@@ -430,6 +564,7 @@ void ZygiskContext::nativeForkSystemServer_pre() {
     ZLOGV("pre  forkSystemServer\n");
     flags |= SERVER_FORK_AND_SPECIALIZE;
 
+    load_zygote_modules();
     fork_pre();
     if (is_child()) {
         server_specialize_pre();
@@ -450,6 +585,7 @@ void ZygiskContext::nativeForkAndSpecialize_pre() {
     ZLOGV("pre  forkAndSpecialize [%s]\n", process);
     flags |= APP_FORK_AND_SPECIALIZE;
 
+    load_zygote_modules();
     fork_pre();
     if (is_child()) {
         app_specialize_pre();
@@ -3,6 +3,9 @@
 #include <regex.h>
 #include <bitset>
 #include <list>
+#include <map>
+
+#include <lsplt.hpp>
 
 #include "api.hpp"
 
@@ -133,6 +136,11 @@ enum : uint32_t {
     PRIVATE_MASK = (DENYLIST_ENFORCING | PROCESS_IS_MAGISK_APP)
 };
 
+static inline bool should_load_modules(uint32_t flags) {
+    return (flags & UNMOUNT_MASK) != UNMOUNT_MASK &&
+           (flags & PROCESS_IS_MAGISK_APP) != PROCESS_IS_MAGISK_APP;
+}
+
 struct api_abi_base {
     ZygiskModule *impl;
     bool (*registerModule)(ApiTable *, long *);
@@ -187,6 +195,8 @@ struct ZygiskModule {
     void setOption(zygisk::Option opt);
     static uint32_t getFlags();
     void tryUnload() const;
+    void forceUnload() const;
+    bool shared() const { return share; }
     void clearApi() { memset(&api, 0, sizeof(api)); }
     int getId() const { return id; }
 
@@ -197,6 +207,7 @@ struct ZygiskModule {
 private:
     const int id;
     bool unload = false;
+    bool share = false;
 
     void * const handle;
     union {
@@ -213,6 +224,7 @@ private:
 };
 
 extern ZygiskContext *g_ctx;
+void release_zygote_modules();
 extern int (*old_fork)(void);
 
 enum : uint32_t {
@@ -226,6 +238,19 @@ enum : uint32_t {
 
 #define MAX_FD_SIZE 1024
 
+// Parsed /proc/self/maps shared by all hooking phases.
+// It is only rebuilt after the linker loaded or unloaded a library.
+struct MapSnapshot {
+    std::vector<lsplt::MapInfo> maps;
+    // The first file backed mapping of every library, indexed by file name
+    std::map<std::string_view, const lsplt::MapInfo *> by_name;
+
+    // Find a library by its file name, e.g. "libart.so"
+    const lsplt::MapInfo *find(std::string_view name) const;
+};
+
+const MapSnapshot &get_maps();
+
 #define DCL_PRE_POST(name) \
 void name##_pre();         \
 void name##_post();
@@ -246,6 +271,8 @@ struct ZygiskContext {
     uint32_t info_flags;
     std::bitset<MAX_FD_SIZE> allowed_fds;
     std::vector<int> exempted_fds;
+    // Mapped null separated unmount targets received from magiskd
+    std::string_view unmount_targets;
 
     struct RegisterInfo {
         regex_t regex;
@@ -266,7 +293,8 @@ struct ZygiskContext {
     ZygiskContext(JNIEnv *env, void *args);
     ~ZygiskContext();
 
-    void run_modules_pre(const std::vector<int> &fds);
+    void load_zygote_modules();
+    void run_modules_pre(int bundle);
     void run_modules_post();
     DCL_PRE_POST(fork)
     DCL_PRE_POST(app_specialize)
@@ -11,6 +11,7 @@ enum : int {
     GET_INFO,
     CONNECT_COMPANION,
     GET_MODDIR,
+    GET_MODULES,
     END
 };
 }
@@ -35,6 +36,8 @@ void hook_functions();
 void hookJniNativeMethods(JNIEnv *env, const char *clz, JNINativeMethod *methods, int numMethods);
 
 int remote_get_info(int uid, const char *process, uint32_t *flags, std::vector<int> &fds);
+std::vector<module_bundle_entry> read_module_bundle(int fd);
+void *dlopen_module(int fd, const module_bundle_entry &e);
 
 inline int zygisk_request(int req) {
     int fd = connect_daemon(+RequestCode::ZYGISK);
@@ -8,6 +8,7 @@
 #define MODULEUPGRADE   SECURE_DIR "/modules_update"
 #define DATABIN         SECURE_DIR "/magisk"
 #define MAGISKDB        SECURE_DIR "/magisk.db"
+#define MOUNTPLAN       SECURE_DIR "/mount_plan"
 
 // tmpfs paths
 #define INTLROOT      ".magisk"
@@ -17,11 +18,15 @@
 #define PREINITDEV    BLOCKDIR "/preinit"
 #define WORKERDIR     INTLROOT "/worker"
 #define MODULEMNT     INTLROOT "/modules"
+#define OVERLAYDIR    INTLROOT "/overlay"
+#define REPLACEDIR    INTLROOT "/replace"
 #define BBPATH        INTLROOT "/busybox"
 #define ROOTOVL       INTLROOT "/rootdir"
 #define SHELLPTS      INTLROOT "/pts"
 #define ROOTMNT       ROOTOVL  "/.mount_list"
 #define SELINUXMOCK   INTLROOT "/selinux"
+#define SEPOLCACHE    INTLROOT "/sepolicy.cache"
+#define PREINITSEPOL  PREINITMIRR "/sepolicy.cache"
 #define MAIN_CONFIG   INTLROOT "/config"
 #define MAIN_SOCKET   INTLROOT "/socket"
 #define LOG_PIPE      INTLROOT "/log"
@@ -30,6 +35,7 @@ constexpr const char *applet_names[] = { "su", "resetprop", nullptr };
 
 #define POST_FS_DATA_WAIT_TIME       40
 #define POST_FS_DATA_SCRIPT_MAX_TIME 35
+#define MODULE_SCRIPT_MAX_TIME       20
 
 // Unconstrained domain the daemon and root processes run in
 #define SEPOL_PROC_DOMAIN   "magisk"
@@ -27,3 +27,10 @@ macro_rules! MAIN_CONFIG {
         concat!($crate::INTLROOT!(), "/config")
     };
 }
+
+#[macro_export]
+macro_rules! PERSIST_SNAPSHOT {
+    () => {
+        concat!($crate::INTLROOT!(), "/persist_props")
+    };
+}
@@ -1,13 +1,62 @@
+use digest::DynDigest;
 use logging::setup_klog;
 // Has to be pub so all symbols in that crate is included
 pub use magiskpolicy;
+use sha1::Sha1;
+use sha2::Sha256;
 
 mod logging;
 
 #[cxx::bridge]
 pub mod ffi {
+    extern "Rust" {
+        type SHA;
+        fn get_sha(use_sha1: bool) -> Box<SHA>;
+        fn update(self: &mut SHA, data: &[u8]);
+        fn finalize_into(self: &mut SHA, out: &mut [u8]);
+        fn output_size(self: &SHA) -> usize;
+    }
+
     #[namespace = "rust"]
     extern "Rust" {
         fn setup_klog();
     }
 }
+
+#[allow(clippy::upper_case_acronyms)]
+pub enum SHA {
+    SHA1(Sha1),
+    SHA256(Sha256),
+}
+
+impl SHA {
+    fn update(&mut self, data: &[u8]) {
+        match self {
+            SHA::SHA1(h) => h.update(data),
+            SHA::SHA256(h) => h.update(data),
+        }
+    }
+
+    fn output_size(&self) -> usize {
+        match self {
+            SHA::SHA1(h) => h.output_size(),
+            SHA::SHA256(h) => h.output_size(),
+        }
+    }
+
+    fn finalize_into(&mut self, out: &mut [u8]) {
+        match self {
+            SHA::SHA1(h) => h.finalize_into_reset(out),
+            SHA::SHA256(h) => h.finalize_into_reset(out),
+        }
+        .ok();
+    }
+}
+
+fn get_sha(use_sha1: bool) -> Box<SHA> {
+    Box::new(if use_sha1 {
+        SHA::SHA1(Sha1::default())
+    } else {
+        SHA::SHA256(Sha256::default())
+    })
+}
@@ -3,33 +3,132 @@
 #include <consts.hpp>
 #include <sepolicy.hpp>
 #include <embed.hpp>
+#include <flags.h>
 
 #include "init.hpp"
 
 using namespace std;
 
-void MagiskInit::patch_sepolicy(const char *in, const char *out) {
-    LOGD("Patching monolithic policy\n");
-    auto sepol = unique_ptr<sepolicy>(sepolicy::from_file(in));
+#define SEPOL_CACHE_MAGIC "MSPC"
 
-    sepol->magisk_rules();
+// The policy cache is the patched binary policy followed by this trailer
+struct sepol_cache_trailer {
+    uint8_t key[32];
+    uint32_t size;
+    char magic[4];
+};
 
-    // Custom rules
+// Read all custom rules into memory
+static string read_custom_rules() {
+    string rules;
     if (auto dir = xopen_dir("/data/" PREINITMIRR)) {
         for (dirent *entry; (entry = xreaddir(dir.get()));) {
             auto name = "/data/" PREINITMIRR "/"s + entry->d_name;
-            auto rule = name + "/sepolicy.rule";
-            if (xaccess(rule.data(), R_OK) == 0 &&
+            auto rule_file = name + "/sepolicy.rule";
+            if (xaccess(rule_file.data(), R_OK) == 0 &&
                 access((name + "/disable").data(), F_OK) != 0 &&
                 access((name + "/remove").data(), F_OK) != 0) {
-                LOGD("Loading custom sepolicy patch: [%s]\n", rule.data());
-                sepol->load_rule_file(rule.data());
+                LOGD("Load custom sepolicy patch: [%s]\n", rule_file.data());
+                full_read(rule_file.data(), rules);
+                rules += '\n';
             }
         }
     }
+    return rules;
+}
+
+// Our own binary embeds the rules we patch with, so any rebuild changes the digest
+static byte_view self_digest() {
+    static uint8_t digest[32];
+    static bool done = false;
+    if (!done) {
+        auto sha = get_sha(false);
+        sha->update(mmap_data("/proc/self/exe"));
+        sha->finalize_into(byte_data(digest, sizeof(digest)));
+        done = true;
+    }
+    return byte_view(digest, sizeof(digest));
+}
+
+// The cache key covers everything that decides the patched policy:
+// our own build, the source policy, and all custom rules
+static void policy_cache_key(const char *policy, const string &rules, uint8_t *key) {
+    auto sha = get_sha(false);
+    sha->update(byte_view(MAGISK_FULL_VER));
+    sha->update(self_digest());
+    sha->update(mmap_data(policy));
+    sha->update(byte_view(rules, false));
+    sha->finalize_into(byte_data(key, sizeof(sepol_cache_trailer::key)));
+}
+
+static bool write_policy(const char *out, byte_view policy) {
+    // No partial writes are allowed to /sys/fs/selinux/load
+    int fd = xopen(out, O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0)
+        return false;
+    if (struct stat st{}; xfstat(fd, &st) == 0 && st.st_size > 0) {
+        ftruncate(fd, 0);
+    }
+    bool ok = xwrite(fd, policy.buf(), policy.sz()) == (ssize_t) policy.sz();
+    close(fd);
+    return ok;
+}
+
+// Output the cached policy if it was generated from the same inputs
+static bool load_cached_policy(const uint8_t *key, const char *out) {
+    if (access(PREINITSEPOL, R_OK) != 0)
+        return false;
+    mmap_data cache(PREINITSEPOL);
+    sepol_cache_trailer trailer{};
+    if (cache.sz() < sizeof(trailer))
+        return false;
+    size_t size = cache.sz() - sizeof(trailer);
+    memcpy(&trailer, cache.buf() + size, sizeof(trailer));
+    if (memcmp(trailer.magic, SEPOL_CACHE_MAGIC, sizeof(trailer.magic)) != 0 ||
+        trailer.size != size || memcmp(trailer.key, key, sizeof(trailer.key)) != 0) {
+        LOGD("Cached sepolicy is outdated\n");
+        return false;
+    }
+    LOGD("Load cached sepolicy to: [%s]\n", out);
+    return write_policy(out, byte_view(cache.buf(), size));
+}
 
+// Output the patched policy, and keep a copy with its key in tmpfs.
+// The preinit partition is read-only at this point, magiskd will move it there.
+static void dump_policy(sepolicy *sepol, const uint8_t *key, const char *out) {
     LOGD("Dumping sepolicy to: [%s]\n", out);
-    sepol->to_file(out);
+    if (!sepol->to_file(SEPOLCACHE)) {
+        sepol->to_file(out);
+        return;
+    }
+    {
+        mmap_data policy(SEPOLCACHE);
+        write_policy(out, policy);
+
+        sepol_cache_trailer trailer{};
+        memcpy(trailer.key, key, sizeof(trailer.key));
+        trailer.size = policy.sz();
+        memcpy(trailer.magic, SEPOL_CACHE_MAGIC, sizeof(trailer.magic));
+        int fd = xopen(SEPOLCACHE, O_WRONLY | O_APPEND | O_CLOEXEC);
+        if (fd >= 0) {
+            xwrite(fd, &trailer, sizeof(trailer));
+            close(fd);
+        }
+    }
+}
+
+void MagiskInit::patch_sepolicy(const char *in, const char *out) {
+    LOGD("Patching monolithic policy\n");
+    string rules = read_custom_rules();
+
+    uint8_t key[sizeof(sepol_cache_trailer::key)];
+    policy_cache_key(in, rules, key);
+    if (!load_cached_policy(key, out)) {
+        auto sepol = unique_ptr<sepolicy>(sepolicy::from_file(in));
+        sepol->magisk_rules();
+        sepol->load_rules(rules);
+        dump_policy(sepol.get(), key, out);
+    }
 
     // Remove OnePlus stupid debug sepolicy and use our own
     if (access("/sepolicy_debug", F_OK) == 0) {
@@ -106,20 +205,10 @@ bool MagiskInit::hijack_sepolicy() {
     }
 
     // Read all custom rules into memory
-    string rules;
-    if (auto dir = xopen_dir("/data/" PREINITMIRR)) {
-        for (dirent *entry; (entry = xreaddir(dir.get()));) {
-            auto name = "/data/" PREINITMIRR "/"s + entry->d_name;
-            auto rule_file = name + "/sepolicy.rule";
-            if (xaccess(rule_file.data(), R_OK) == 0 &&
-                access((name + "/disable").data(), F_OK) != 0 &&
-                access((name + "/remove").data(), F_OK) != 0) {
-                LOGD("Load custom sepolicy patch: [%s]\n", rule_file.data());
-                full_read(rule_file.data(), rules);
-                rules += '\n';
-            }
-        }
-    }
+    string rules = read_custom_rules();
+    // procfs is not guaranteed to stay around for the child
+    self_digest();
+
     // Create a new process waiting for init operations
     if (xfork()) {
         // In parent, return and continue boot process
@@ -149,13 +238,15 @@ bool MagiskInit::hijack_sepolicy() {
     xumount2(SELINUX_LOAD, MNT_DETACH);
     xumount2(SELINUX_ENFORCE, MNT_DETACH);
 
-    // Load and patch policy
-    auto sepol = unique_ptr<sepolicy>(sepolicy::from_file(MOCK_LOAD));
-    sepol->magisk_rules();
-    sepol->load_rules(rules);
-
-    // Load patched policy into kernel
-    sepol->to_file(SELINUX_LOAD);
+    // Load patched policy into kernel, skip patching if the cache is up-to-date
+    uint8_t key[sizeof(sepol_cache_trailer::key)];
+    policy_cache_key(MOCK_LOAD, rules, key);
+    if (!load_cached_policy(key, SELINUX_LOAD)) {
+        auto sepol = unique_ptr<sepolicy>(sepolicy::from_file(MOCK_LOAD));
+        sepol->magisk_rules();
+        sepol->load_rules(rules);
+        dump_policy(sepol.get(), key, SELINUX_LOAD);
+    }
 
     // Write to the enforce node ONLY after sepolicy is loaded. We need to make sure
     // the actual init process is blocked until sepolicy is loaded, or else
@@ -105,9 +105,13 @@ bool sepolicy::exists(const char *type) {
 }
 
 void sepolicy::load_rule_file(const char *file) {
+    impl->begin_batch();
     rust::load_rule_file(*this, file);
+    impl->end_batch();
 }
 
 void sepolicy::load_rules(const std::string &rules) {
+    impl->begin_batch();
     rust::load_rules(*this, byte_view(rules, false));
+    impl->end_batch();
 }
@@ -43,7 +43,9 @@ struct sepolicy {
     void parse_statement(rust::Str stmt);
     void load_rules(const std::string &rules);
     void load_rule_file(c_str file);
-    void print_rules();
+    void print_rules(c_str src = nullptr, c_str tgt = nullptr, c_str cls = nullptr);
+    // Print rules only in this policy with '-', and only in other with '+'
+    bool print_diff(sepolicy *other);
 
     // Operation on types
     bool type(c_str name, c_str attr);
@@ -5,7 +5,7 @@
 
 using namespace std;
 
-[[noreturn]] static void usage(char *arg0) {
+[[noreturn]] static void usage(char *arg0, int code = 1) {
     fprintf(stderr,
 R"EOF(MagiskPolicy - SELinux Policy Patch Tool
 
@@ -24,12 +24,20 @@ Options:
                      line by line as policy statements
                      (multiple --apply are allowed)
    --print-rules     print all rules in the loaded sepolicy
+   --source TYPE     only print rules with source TYPE or its attributes
+   --target TYPE     only print rules with target TYPE or its attributes
+   --class CLASS     only print rules with class CLASS
+   --diff FILE1 FILE2
+                     print rules that differ between two monolithic
+                     sepolicy files, '-' for rules only in FILE1 and
+                     '+' for rules only in FILE2; exit with 0 if same,
+                     1 if differ, and 2 on errors
 
 If neither --load, --load-split, nor --compile-split is specified,
 it will load from current live policies (/sys/fs/selinux/policy)
 
 )EOF", arg0);
-    exit(1);
+    exit(code);
 }
 
 int main(int argc, char *argv[]) {
@@ -40,6 +48,9 @@ int main(int argc, char *argv[]) {
     bool magisk = false;
     bool live = false;
     bool print = false;
+    const char *print_src = nullptr;
+    const char *print_tgt = nullptr;
+    const char *print_cls = nullptr;
 
     if (argc < 2) usage(argv[0]);
     int i = 1;
@@ -79,11 +90,27 @@ int main(int argc, char *argv[]) {
                     usage(argv[0]);
                 out_file = argv[i + 1];
                 ++i;
+            } else if (option == "source"sv || option == "target"sv || option == "class"sv) {
+                if (argv[i + 1] == nullptr)
+                    usage(argv[0]);
+                (option == "source"sv ? print_src :
+                 option == "target"sv ? print_tgt : print_cls) = argv[i + 1];
+                ++i;
             } else if (option == "apply"sv) {
                 if (argv[i + 1] == nullptr)
                     usage(argv[0]);
                 rule_files.emplace_back(argv[i + 1]);
                 ++i;
+            } else if (option == "diff"sv) {
+                if (argv[i + 1] == nullptr || argv[i + 2] == nullptr)
+                    usage(argv[0], 2);
+                auto a = unique_ptr<sepolicy>(sepolicy::from_file(argv[i + 1]));
+                auto b = unique_ptr<sepolicy>(sepolicy::from_file(argv[i + 2]));
+                if (!a || !b) {
+                    fprintf(stderr, "Cannot load policy from %s\n", argv[a ? i + 2 : i + 1]);
+                    return 2;
+                }
+                return a->print_diff(b.get()) ? 1 : 0;
             } else if (option == "help"sv) {
                 statement_help();
             } else {
@@ -101,10 +128,13 @@ int main(int argc, char *argv[]) {
     }
 
     if (print) {
-        sepol->print_rules();
+        sepol->print_rules(print_src, print_tgt, print_cls);
         return 0;
     }
 
+    auto policy = reinterpret_cast<sepol_impl *>(sepol);
+    policy->begin_batch();
+
     if (magisk)
         sepol->magisk_rules();
 
@@ -115,6 +145,8 @@ int main(int argc, char *argv[]) {
     for (; i < argc; ++i)
         sepol->parse_statement(argv[i]);
 
+    policy->end_batch();
+
     if (live && !sepol->to_file(SELINUX_LOAD)) {
         fprintf(stderr, "Cannot apply policy\n");
         return 1;
@@ -2,8 +2,11 @@
 
 // Internal APIs, do not use directly
 
-#include <map>
+#include <array>
+#include <functional>
 #include <string_view>
+#include <unordered_map>
+#include <vector>
 
 #include <sepol/policydb/policydb.h>
 #include <sepolicy.hpp>
@@ -16,10 +19,13 @@ struct sepol_impl : public sepolicy {
     avtab_ptr_t get_avtab_node(avtab_key_t *key, avtab_extended_perms_t *xperms);
     void print_type(FILE *fp, type_datum_t *type);
     void print_avtab(FILE *fp, avtab_ptr_t node);
-    void print_filename_trans(FILE *fp, hashtab_ptr_t node);
+    void print_filename_trans(FILE *fp, hashtab_ptr_t node, const std::vector<bool> &src_match);
+    void init_perm_names();
+    void for_each_rule(const std::function<void(std::string_view)> &fn);
 
     bool add_rule(const char *s, const char *t, const char *c, const char *p, int effect, bool invert);
     void add_rule(type_datum_t *src, type_datum_t *tgt, class_datum_t *cls, perm_datum_t *perm, int effect, bool invert);
+    void apply_av(avtab_key_t *key, uint32_t keep, uint32_t set);
     void add_xperm_rule(type_datum_t *src, type_datum_t *tgt, class_datum_t *cls, const argument &xperm, int effect);
     bool add_xperm_rule(const char *s, const char *t, const char *c, const argument &xperm, int effect);
     bool add_type_rule(const char *s, const char *t, const char *c, const char *d, int effect);
@@ -31,13 +37,34 @@ struct sepol_impl : public sepolicy {
     bool add_typeattribute(const char *type, const char *attr);
     void strip_dontaudit();
 
+    // Within a batch, av rules are merged per avtab key and only
+    // written to te_avtab when the outermost batch ends
+    void begin_batch();
+    void end_batch();
+    void commit_batch();
+
     sepol_impl(policydb *db) : db(db) {}
     ~sepol_impl();
 
     policydb *db;
 
 private:
-    std::map<std::string_view, std::array<const char *, 32>> class_perm_names;
+    const std::vector<type_datum_t *> &all_types(bool attr_only);
+
+    // Permission names of each class, indexed by class value - 1
+    std::vector<std::array<const char *, 32>> class_perm_names;
+
+    // Types and attributes to expand the match-all operator, reset when new types are added
+    std::vector<type_datum_t *> type_cache;
+    std::vector<type_datum_t *> attr_cache;
+
+    // Pending av rules: data = (data & keep) | set
+    struct av_masks {
+        uint32_t keep;
+        uint32_t set;
+    };
+    std::unordered_map<uint64_t, av_masks> batch_rules;
+    int batch_depth = 0;
 };
 
 #define impl reinterpret_cast<sepol_impl *>(this)
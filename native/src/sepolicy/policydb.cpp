@@ -1,81 +1,57 @@
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/vfs.h>
+#include <linux/magic.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <thread>
 
 #include <cil/cil.h>
 
 #include <base.hpp>
-#include <stream.hpp>
 
 #include "policy.hpp"
 
+using namespace std;
+
 #define SHALEN 64
-static bool cmp_sha256(const char *a, const char *b) {
-    char id_a[SHALEN] = {0};
-    char id_b[SHALEN] = {0};
-    if (int fd = xopen(a, O_RDONLY | O_CLOEXEC); fd >= 0) {
-        xread(fd, id_a, SHALEN);
-        close(fd);
-    } else {
-        return false;
-    }
 
-    if (int fd = xopen(b, O_RDONLY | O_CLOEXEC); fd >= 0) {
-        xread(fd, id_b, SHALEN);
-        close(fd);
-    } else {
-        return false;
-    }
-    LOGD("%s=[%.*s]\n", a, SHALEN, id_a);
-    LOGD("%s=[%.*s]\n", b, SHALEN, id_b);
-    return memcmp(id_a, id_b, SHALEN) == 0;
+// Hashes of the split policy inputs, and the suffix of the copy saved along with the precompiled policy
+static const pair<const char *, const char *> split_sha256[] = {
+    { PLAT_POLICY_DIR "plat_and_mapping_sepolicy.cil.sha256", ".plat_and_mapping.sha256" },
+    { PLAT_POLICY_DIR "plat_sepolicy_and_mapping.sha256", ".plat_sepolicy_and_mapping.sha256" },
+    { PROD_POLICY_DIR "product_sepolicy_and_mapping.sha256", ".product_sepolicy_and_mapping.sha256" },
+    { SYSEXT_POLICY_DIR "system_ext_sepolicy_and_mapping.sha256", ".system_ext_sepolicy_and_mapping.sha256" },
+};
+
+static void append_sha256(int fd, string &out) {
+    char id[SHALEN] = {0};
+    xread(fd, id, SHALEN);
+    close(fd);
+    out.append(id, SHALEN);
 }
 
+// All hashes are combined into a single key, so one comparison
+// decides whether the precompiled policy matches its inputs
 static bool check_precompiled(const char *precompiled) {
-    bool ok = false;
-    const char *actual_sha;
-    char compiled_sha[128];
-
-    actual_sha = PLAT_POLICY_DIR "plat_and_mapping_sepolicy.cil.sha256";
-    if (access(actual_sha, R_OK) == 0) {
-        ok = true;
-        sprintf(compiled_sha, "%s.plat_and_mapping.sha256", precompiled);
-        if (!cmp_sha256(actual_sha, compiled_sha))
-            return false;
-    }
-
-    actual_sha = PLAT_POLICY_DIR "plat_sepolicy_and_mapping.sha256";
-    if (access(actual_sha, R_OK) == 0) {
-        ok = true;
-        sprintf(compiled_sha, "%s.plat_sepolicy_and_mapping.sha256", precompiled);
-        if (!cmp_sha256(actual_sha, compiled_sha))
-            return false;
-    }
-
-    actual_sha = PROD_POLICY_DIR "product_sepolicy_and_mapping.sha256";
-    if (access(actual_sha, R_OK) == 0) {
-        ok = true;
-        sprintf(compiled_sha, "%s.product_sepolicy_and_mapping.sha256", precompiled);
-        if (!cmp_sha256(actual_sha, compiled_sha) != 0)
+    string actual;
+    string compiled;
+    char path[128];
+    for (auto [actual_sha, suffix] : split_sha256) {
+        int fd = open(actual_sha, O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
+            continue;
+        append_sha256(fd, actual);
+        ssprintf(path, sizeof(path), "%s%s", precompiled, suffix);
+        if ((fd = xopen(path, O_RDONLY | O_CLOEXEC)) < 0)
             return false;
+        append_sha256(fd, compiled);
     }
-
-    actual_sha = SYSEXT_POLICY_DIR "system_ext_sepolicy_and_mapping.sha256";
-    if (access(actual_sha, R_OK) == 0) {
-        ok = true;
-        sprintf(compiled_sha, "%s.system_ext_sepolicy_and_mapping.sha256", precompiled);
-        if (!cmp_sha256(actual_sha, compiled_sha) != 0)
-            return false;
-    }
-
-    return ok;
-}
-
-static void load_cil(struct cil_db *db, const char *file) {
-    mmap_data d(file);
-    cil_add_file(db, file, (const char *) d.buf(), d.sz());
-    LOGD("cil_add [%s]\n", file);
+    if (actual.empty())
+        return false;
+    LOGD("%s: [%.*s]\n", precompiled, (int) compiled.size(), compiled.data());
+    LOGD("split policy: [%.*s]\n", (int) actual.size(), actual.data());
+    return actual == compiled;
 }
 
 sepolicy *sepolicy::from_data(char *data, size_t len) {
@@ -119,12 +95,11 @@ sepolicy *sepolicy::from_file(const char *file) {
 }
 
 sepolicy *sepolicy::compile_split() {
-    char path[128], plat_ver[10];
+    char plat_ver[10];
     cil_db_t *db = nullptr;
     sepol_policydb_t *pdb = nullptr;
     FILE *f;
     int policy_ver;
-    const char *cil_file;
 #if MAGISK_DEBUG
     cil_set_log_level(CIL_INFO);
 #endif
@@ -158,55 +133,56 @@ sepolicy *sepolicy::compile_split() {
     fscanf(f, "%s", plat_ver);
     fclose(f);
 
-    // plat
-    load_cil(db, SPLIT_PLAT_CIL);
-
-    sprintf(path, PLAT_POLICY_DIR "mapping/%s.cil", plat_ver);
-    load_cil(db, path);
-
-    sprintf(path, PLAT_POLICY_DIR "mapping/%s.compat.cil", plat_ver);
-    if (access(path, R_OK) == 0)
-        load_cil(db, path);
-
-    // system_ext
-    sprintf(path, SYSEXT_POLICY_DIR "mapping/%s.cil", plat_ver);
-    if (access(path, R_OK) == 0)
-        load_cil(db, path);
-
-    sprintf(path, SYSEXT_POLICY_DIR "mapping/%s.compat.cil", plat_ver);
-    if (access(path, R_OK) == 0)
-        load_cil(db, path);
-
-    cil_file = SYSEXT_POLICY_DIR "system_ext_sepolicy.cil";
-    if (access(cil_file, R_OK) == 0)
-        load_cil(db, cil_file);
-
-    // product
-    sprintf(path, PROD_POLICY_DIR "mapping/%s.cil", plat_ver);
-    if (access(path, R_OK) == 0)
-        load_cil(db, path);
-
-    cil_file = PROD_POLICY_DIR "product_sepolicy.cil";
-    if (access(cil_file, R_OK) == 0)
-        load_cil(db, cil_file);
-
-    // vendor
-    cil_file = VEND_POLICY_DIR "nonplat_sepolicy.cil";
-    if (access(cil_file, R_OK) == 0)
-        load_cil(db, cil_file);
-
-    cil_file = VEND_POLICY_DIR "plat_pub_versioned.cil";
-    if (access(cil_file, R_OK) == 0)
-        load_cil(db, cil_file);
-
-    cil_file = VEND_POLICY_DIR "vendor_sepolicy.cil";
-    if (access(cil_file, R_OK) == 0)
-        load_cil(db, cil_file);
+    // All CIL files in the order they have to be added; only the first 2 are required
+    vector<string> files {
+        // plat
+        SPLIT_PLAT_CIL,
+        PLAT_POLICY_DIR "mapping/"s + plat_ver + ".cil",
+        PLAT_POLICY_DIR "mapping/"s + plat_ver + ".compat.cil",
+        // system_ext
+        SYSEXT_POLICY_DIR "mapping/"s + plat_ver + ".cil",
+        SYSEXT_POLICY_DIR "mapping/"s + plat_ver + ".compat.cil",
+        SYSEXT_POLICY_DIR "system_ext_sepolicy.cil",
+        // product
+        PROD_POLICY_DIR "mapping/"s + plat_ver + ".cil",
+        PROD_POLICY_DIR "product_sepolicy.cil",
+        // vendor
+        VEND_POLICY_DIR "nonplat_sepolicy.cil",
+        VEND_POLICY_DIR "plat_pub_versioned.cil",
+        VEND_POLICY_DIR "vendor_sepolicy.cil",
+        // odm
+        ODM_POLICY_DIR "odm_sepolicy.cil",
+    };
+
+    // Reading the files is I/O bound, do it in parallel
+    vector<string> data(files.size());
+    vector<char> found(files.size());
+    {
+        vector<thread> readers;
+        for (int i = 0; i < files.size(); ++i) {
+            readers.emplace_back([&, i] {
+                int fd = i < 2 ? xopen(files[i].data(), O_RDONLY | O_CLOEXEC)
+                               : open(files[i].data(), O_RDONLY | O_CLOEXEC);
+                if (fd < 0)
+                    return;
+                full_read(fd, data[i]);
+                close(fd);
+                found[i] = 1;
+            });
+        }
+        for (auto &t : readers)
+            t.join();
+    }
 
-    // odm
-    cil_file = ODM_POLICY_DIR "odm_sepolicy.cil";
-    if (access(cil_file, R_OK) == 0)
-        load_cil(db, cil_file);
+    // The CIL database is not thread-safe, files have to be parsed one by one
+    for (int i = 0; i < files.size(); ++i) {
+        if (!found[i])
+            continue;
+        cil_add_file(db, files[i].data(), data[i].data(), data[i].size());
+        LOGD("cil_add [%s]\n", files[i].data());
+        // libsepol keeps its own copy
+        string().swap(data[i]);
+    }
 
     if (cil_compile(db))
         return nullptr;
@@ -234,28 +210,49 @@ sepol_impl::~sepol_impl() {
 }
 
 bool sepolicy::to_file(const char *file) {
-    // No partial writes are allowed to /sys/fs/selinux/load, thus the reason why we
-    // first dump everything into memory, then directly call write system call
-    heap_data data;
-    auto fp = make_channel_fp<byte_channel>(data);
+    int fd = xopen(file, O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0)
+        return false;
+    if (struct stat st{}; xfstat(fd, &st) == 0 && st.st_size > 0) {
+        ftruncate(fd, 0);
+    }
 
     policy_file_t pf;
     policy_file_init(&pf);
+
+    if (struct statfs sfs{}; fstatfs(fd, &sfs) == 0 && sfs.f_type == SELINUX_MAGIC) {
+        // No partial writes are allowed to /sys/fs/selinux/load, thus the reason why we
+        // first dump everything into memory, then directly call write system call.
+        // Calculate the exact size beforehand so the buffer is never reallocated.
+        run_finally close_fd([=] { close(fd); });
+        pf.type = PF_LEN;
+        if (policydb_write(impl->db, &pf)) {
+            LOGE("Fail to create policy image\n");
+            return false;
+        }
+        heap_data data(pf.len);
+        policy_file_init(&pf);
+        pf.type = PF_USE_MEMORY;
+        pf.data = reinterpret_cast<char *>(data.buf());
+        pf.len = data.sz();
+        if (policydb_write(impl->db, &pf)) {
+            LOGE("Fail to create policy image\n");
+            return false;
+        }
+        return xwrite(fd, data.buf(), data.sz()) == (ssize_t) data.sz();
+    }
+
+    // Other destinations can be written directly
+    auto fp = xopen_file(fd, "we");
+    if (!fp) {
+        close(fd);
+        return false;
+    }
     pf.type = PF_USE_STDIO;
     pf.fp = fp.get();
     if (policydb_write(impl->db, &pf)) {
-        LOGE("Fail to create policy image\n");
+        LOGE("Fail to write policy to %s\n", file);
         return false;
     }
-
-    int fd = xopen(file, O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
-    if (fd < 0)
-        return false;
-    if (struct stat st{}; xfstat(fd, &st) == 0 && st.st_size > 0) {
-        ftruncate(fd, 0);
-    }
-    xwrite(fd, data.buf(), data.sz());
-
-    close(fd);
-    return true;
+    return fflush(fp.get()) == 0;
 }
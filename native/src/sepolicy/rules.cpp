@@ -8,6 +8,7 @@ using namespace std;
 void sepolicy::magisk_rules() {
     // Temp suppress warnings
     set_log_level_state(LogLevel::Warn, false);
+    impl->begin_batch();
 
     // Prevent anything to change sepolicy except ourselves
     deny(ALL, "kernel", "security", "load_policy");
@@ -125,6 +126,8 @@ void sepolicy::magisk_rules() {
     deny("init", "adb_data_file", "dir", "search");
     deny("vendor_init", "adb_data_file", "dir", "search");
 
+    impl->end_batch();
+
 #if 0
     // Remove all dontaudit in debug mode
     impl->strip_dontaudit();
@@ -1,4 +1,9 @@
+#include <algorithm>
+#include <functional>
+#include <thread>
+
 #include <base.hpp>
+#include <stream.hpp>
 
 #include "policy.hpp"
 
@@ -75,20 +80,6 @@ static void hashtab_for_each(hashtab_t htab, const Func &fn) {
     hash_for_each(htab->htable, htab->size, fn);
 }
 
-template <class Func>
-static void avtab_for_each(avtab_t *avtab, const Func &fn) {
-    hash_for_each(avtab->htable, avtab->nslot, fn);
-}
-
-template <class Func>
-static void for_each_attr(hashtab_t htab, const Func &fn) {
-    hashtab_for_each(htab, [&](hashtab_ptr_t node) {
-        auto type = static_cast<type_datum_t *>(node->datum);
-        if (type->flavor == TYPE_ATTRIB)
-            fn(type);
-    });
-}
-
 static int avtab_remove_node(avtab_t *h, avtab_ptr_t node) {
     if (!h || !h->htable)
         return SEPOL_ENOMEM;
@@ -167,28 +158,47 @@ avtab_ptr_t sepol_impl::get_avtab_node(avtab_key_t *key, avtab_extended_perms_t
     return node;
 }
 
+const vector<type_datum_t *> &sepol_impl::all_types(bool attr_only) {
+    auto &cache = attr_only ? attr_cache : type_cache;
+    if (cache.empty()) {
+        hashtab_for_each(db->p_types.table, [&](hashtab_ptr_t node) {
+            auto type = static_cast<type_datum_t *>(node->datum);
+            if (!attr_only || type->flavor == TYPE_ATTRIB)
+                cache.push_back(type);
+        });
+    }
+    return cache;
+}
+
+static uint64_t av_key(const avtab_key_t *key) {
+    return (uint64_t) key->source_type << 48 | (uint64_t) key->target_type << 32 |
+           (uint64_t) key->target_class << 16 | key->specified;
+}
+
+void sepol_impl::apply_av(avtab_key_t *key, uint32_t keep, uint32_t set) {
+    avtab_ptr_t node = find_avtab_node(key, nullptr);
+    if (node == nullptr) {
+        // Do not create nodes that would be immediately removed as redundant
+        uint32_t init = key->specified == AVTAB_AUDITDENY ? ~0U : 0U;
+        if (((init & keep) | set) == init)
+            return;
+        node = insert_avtab_node(key);
+    }
+    node->datum.data = (node->datum.data & keep) | set;
+    if (is_redundant(node))
+        avtab_remove_node(&db->te_avtab, node);
+}
+
 void sepol_impl::add_rule(type_datum_t *src, type_datum_t *tgt, class_datum_t *cls, perm_datum_t *perm, int effect, bool invert) {
     if (src == nullptr) {
-        if (strip_av(effect, invert)) {
-            // Stripping av, have to go through all types for correct results
-            hashtab_for_each(db->p_types.table, [&](hashtab_ptr_t node) {
-                add_rule(auto_cast(node->datum), tgt, cls, perm, effect, invert);
-            });
-        } else {
-            // If we are not stripping av, go through all attributes instead of types for optimization
-            for_each_attr(db->p_types.table, [&](type_datum_t *type) {
-                add_rule(type, tgt, cls, perm, effect, invert);
-            });
+        // Stripping av, have to go through all types for correct results.
+        // If we are not stripping av, go through all attributes instead of types for optimization.
+        for (auto type : all_types(!strip_av(effect, invert))) {
+            add_rule(type, tgt, cls, perm, effect, invert);
         }
     } else if (tgt == nullptr) {
-        if (strip_av(effect, invert)) {
-            hashtab_for_each(db->p_types.table, [&](hashtab_ptr_t node) {
-                add_rule(src, auto_cast(node->datum), cls, perm, effect, invert);
-            });
-        } else {
-            for_each_attr(db->p_types.table, [&](type_datum_t *type) {
-                add_rule(src, type, cls, perm, effect, invert);
-            });
+        for (auto type : all_types(!strip_av(effect, invert))) {
+            add_rule(src, type, cls, perm, effect, invert);
         }
     } else if (cls == nullptr) {
         hashtab_for_each(db->p_classes.table, [&](hashtab_ptr_t node) {
@@ -201,24 +211,53 @@ void sepol_impl::add_rule(type_datum_t *src, type_datum_t *tgt, class_datum_t *c
         key.target_class = cls->s.value;
         key.specified = effect;
 
-        avtab_ptr_t node = get_avtab_node(&key, nullptr);
+        uint32_t keep, set;
         if (invert) {
-            if (perm)
-                node->datum.data &= ~(1U << (perm->s.value - 1));
-            else
-                node->datum.data = 0U;
+            keep = perm ? ~(1U << (perm->s.value - 1)) : 0U;
+            set = 0U;
         } else {
-            if (perm)
-                node->datum.data |= 1U << (perm->s.value - 1);
-            else
-                node->datum.data = ~0U;
+            keep = ~0U;
+            set = perm ? 1U << (perm->s.value - 1) : ~0U;
         }
 
-        if (is_redundant(node))
-            avtab_remove_node(&db->te_avtab, node);
+        if (batch_depth == 0) {
+            apply_av(&key, keep, set);
+            return;
+        }
+
+        // Merge with the pending rule of the same key
+        auto [it, inserted] = batch_rules.try_emplace(av_key(&key), av_masks{ keep, set });
+        if (!inserted) {
+            it->second.set = (it->second.set & keep) | set;
+            it->second.keep &= keep;
+        }
     }
 }
 
+void sepol_impl::begin_batch() {
+    ++batch_depth;
+}
+
+void sepol_impl::end_batch() {
+    if (--batch_depth == 0)
+        commit_batch();
+}
+
+void sepol_impl::commit_batch() {
+    if (batch_rules.empty())
+        return;
+    LOGD("sepolicy: commit %zu av rules\n", batch_rules.size());
+    for (auto &[k, masks] : batch_rules) {
+        avtab_key_t key;
+        key.source_type = k >> 48;
+        key.target_type = (k >> 32) & 0xFFFF;
+        key.target_class = (k >> 16) & 0xFFFF;
+        key.specified = k & 0xFFFF;
+        apply_av(&key, masks.keep, masks.set);
+    }
+    batch_rules.clear();
+}
+
 bool sepol_impl::add_rule(const char *s, const char *t, const char *c, const char *p, int effect, bool invert) {
     type_datum_t *src = nullptr, *tgt = nullptr;
     class_datum_t *cls = nullptr;
@@ -272,13 +311,13 @@ bool sepol_impl::add_rule(const char *s, const char *t, const char *c, const cha
 
 void sepol_impl::add_xperm_rule(type_datum_t *src, type_datum_t *tgt, class_datum_t *cls, const argument &xperm, int effect) {
     if (src == nullptr) {
-        for_each_attr(db->p_types.table, [&](type_datum_t *type) {
+        for (auto type : all_types(true)) {
             add_xperm_rule(type, tgt, cls, xperm, effect);
-        });
+        }
     } else if (tgt == nullptr) {
-        for_each_attr(db->p_types.table, [&](type_datum_t *type) {
+        for (auto type : all_types(true)) {
             add_xperm_rule(src, type, cls, xperm, effect);
-        });
+        }
     } else if (cls == nullptr) {
         hashtab_for_each(db->p_classes.table, [&](hashtab_ptr_t node) {
             add_xperm_rule(src, tgt, auto_cast(node->datum), xperm, effect);
@@ -596,6 +635,8 @@ bool sepol_impl::add_type(const char *type_name, uint32_t flavor) {
         return false;
     type->s.value = value;
     ebitmap_set_bit(&db->global->branch_list->declared.p_types_scope, value - 1, 1);
+    type_cache.clear();
+    attr_cache.clear();
 
     auto new_size = sizeof(ebitmap_t) * db->p_types.nprim;
     db->type_attr_map = auto_cast(realloc(db->type_attr_map, new_size));
@@ -683,36 +724,139 @@ bool sepol_impl::add_typeattribute(const char *type, const char *attr) {
 }
 
 void sepol_impl::strip_dontaudit() {
-    avtab_for_each(&db->te_avtab, [=, this](avtab_ptr_t node) {
-        if (node->key.specified == AVTAB_AUDITDENY || node->key.specified == AVTAB_XPERMS_DONTAUDIT)
-            avtab_remove_node(&db->te_avtab, node);
-    });
+    commit_batch();
+    avtab_t *avtab = &db->te_avtab;
+    // Unlink nodes while walking each slot, no need to hash and search again
+    for (uint32_t i = 0; i < avtab->nslot; ++i) {
+        avtab_ptr_t *link = &avtab->htable[i];
+        while (avtab_ptr_t node = *link) {
+            if (node->key.specified == AVTAB_AUDITDENY || node->key.specified == AVTAB_XPERMS_DONTAUDIT) {
+                *link = node->next;
+                avtab->nel--;
+                free(node->datum.xperms);
+                free(node);
+            } else {
+                link = &node->next;
+            }
+        }
+    }
 }
 
-void sepolicy::print_rules() {
-    hashtab_for_each(impl->db->p_types.table, [&](hashtab_ptr_t node) {
-        type_datum_t *type = auto_cast(node->datum);
-        if (type->flavor == TYPE_ATTRIB) {
-            impl->print_type(stdout, type);
+void sepol_impl::init_perm_names() {
+    if (!class_perm_names.empty())
+        return;
+    class_perm_names.resize(db->p_classes.nprim);
+    for (uint32_t i = 0; i < db->p_classes.nprim; ++i) {
+        class_datum_t *clz = db->class_val_to_struct[i];
+        if (clz == nullptr)
+            continue;
+        auto &names = class_perm_names[i];
+        hashtab_for_each(clz->permissions.table, [&](hashtab_ptr_t node) {
+            perm_datum_t *perm = auto_cast(node->datum);
+            names[perm->s.value - 1] = node->key;
+        });
+        if (clz->comdatum) {
+            hashtab_for_each(clz->comdatum->permissions.table, [&](hashtab_ptr_t node) {
+                perm_datum_t *perm = auto_cast(node->datum);
+                names[perm->s.value - 1] = node->key;
+            });
         }
-    });
-    hashtab_for_each(impl->db->p_types.table, [&](hashtab_ptr_t node) {
-        type_datum_t *type = auto_cast(node->datum);
-        if (type->flavor == TYPE_TYPE) {
-            impl->print_type(stdout, type);
+    }
+}
+
+void sepolicy::print_rules(const char *s, const char *t, const char *c) {
+    auto db = impl->db;
+
+    // A rule applies to a type if it is on the type itself or any of its attributes
+    auto type_filter = [&](const char *name, vector<bool> &match) -> bool {
+        match.assign(db->p_types.nprim, name == nullptr);
+        if (name == nullptr)
+            return true;
+        type_datum_t *type = hashtab_find(db->p_types.table, name);
+        if (type == nullptr) {
+            LOGW("type %s does not exist\n", name);
+            return false;
         }
+        match[type->s.value - 1] = true;
+        ebitmap_node_t *n;
+        uint32_t i;
+        ebitmap_for_each_positive_bit(&db->type_attr_map[type->s.value - 1], n, i) {
+            match[i] = true;
+        }
+        return true;
+    };
+    vector<bool> src_match, tgt_match;
+    if (!type_filter(s, src_match) || !type_filter(t, tgt_match))
+        return;
+    uint32_t cls_val = 0;
+    if (c) {
+        class_datum_t *cls = hashtab_find(db->p_classes.table, c);
+        if (cls == nullptr) {
+            LOGW("class %s does not exist\n", c);
+            return;
+        }
+        cls_val = cls->s.value;
+    }
+    auto match = [&](uint32_t src, uint32_t tgt, uint32_t cls) -> bool {
+        return src_match[src - 1] && tgt_match[tgt - 1] && (cls_val == 0 || cls == cls_val);
+    };
+
+    // Declarations are only printed when there is no filter
+    bool filter = s || t || c;
+    if (!filter) {
+        hashtab_for_each(db->p_types.table, [&](hashtab_ptr_t node) {
+            type_datum_t *type = auto_cast(node->datum);
+            if (type->flavor == TYPE_ATTRIB) {
+                impl->print_type(stdout, type);
+            }
+        });
+        hashtab_for_each(db->p_types.table, [&](hashtab_ptr_t node) {
+            type_datum_t *type = auto_cast(node->datum);
+            if (type->flavor == TYPE_TYPE) {
+                impl->print_type(stdout, type);
+            }
+        });
+    }
+
+    // Format chunks of avtab slots in parallel, then output in the original order
+    impl->init_perm_names();
+    {
+        avtab_t *avtab = &db->te_avtab;
+        uint32_t n = std::clamp(thread::hardware_concurrency(), 1u, 8u);
+        uint32_t chunk = (avtab->nslot + n - 1) / n;
+        vector<heap_data> bufs(n);
+        vector<thread> workers;
+        for (uint32_t k = 0; k < n; ++k) {
+            workers.emplace_back([&, k] {
+                auto fp = make_channel_fp<byte_channel>(bufs[k]);
+                uint32_t end = std::min(avtab->nslot, (k + 1) * chunk);
+                for (uint32_t i = k * chunk; i < end; ++i) {
+                    for (avtab_ptr_t node = avtab->htable[i]; node; node = node->next) {
+                        if (match(node->key.source_type, node->key.target_type, node->key.target_class))
+                            impl->print_avtab(fp.get(), node);
+                    }
+                }
+            });
+        }
+        for (uint32_t k = 0; k < n; ++k) {
+            workers[k].join();
+            fwrite(bufs[k].buf(), 1, bufs[k].sz(), stdout);
+        }
+    }
+
+    hashtab_for_each(db->filename_trans, [&](hashtab_ptr_t node) {
+        auto key = reinterpret_cast<filename_trans_key_t *>(node->key);
+        if (filter && (!tgt_match[key->ttype - 1] || (cls_val && key->tclass != cls_val)))
+            return;
+        impl->print_filename_trans(stdout, node, src_match);
     });
-    avtab_for_each(&impl->db->te_avtab, [&](avtab_ptr_t node) {
-        impl->print_avtab(stdout, node);
-    });
-    hashtab_for_each(impl->db->filename_trans, [&](hashtab_ptr_t node) {
-        impl->print_filename_trans(stdout, node);
-    });
-    list_for_each(impl->db->genfs, [&](genfs_t *genfs) {
+    if (filter)
+        return;
+    list_for_each(db->genfs, [&](genfs_t *genfs) {
         list_for_each(genfs->head, [&](ocontext *context) {
             char *ctx = nullptr;
             size_t len = 0;
-            if (context_to_string(nullptr, impl->db, &context->context[0], &ctx, &len) == 0) {
+            if (context_to_string(nullptr, db, &context->context[0], &ctx, &len) == 0) {
                 fprintf(stdout, "genfscon %s %s %s\n", genfs->fstype, context->u.name, ctx);
                 free(ctx);
             }
@@ -728,18 +872,17 @@ void sepol_impl::print_type(FILE *fp, type_datum_t *type) {
         fprintf(fp, "attribute %s\n", name);
     } else if (type->flavor == TYPE_TYPE) {
         bool first = true;
-        ebitmap_t *bitmap = &db->type_attr_map[type->s.value - 1];
-        for (uint32_t i = 0; i <= bitmap->highbit; ++i) {
-            if (ebitmap_get_bit(bitmap, i)) {
-                auto attr_type = db->type_val_to_struct[i];
-                if (attr_type->flavor == TYPE_ATTRIB) {
-                    if (const char *attr = db->p_type_val_to_name[i]) {
-                        if (first) {
-                            fprintf(fp, "type %s {", name);
-                            first = false;
-                        }
-                        fprintf(fp, " %s", attr);
+        ebitmap_node_t *n;
+        uint32_t i;
+        ebitmap_for_each_positive_bit(&db->type_attr_map[type->s.value - 1], n, i) {
+            auto attr_type = db->type_val_to_struct[i];
+            if (attr_type->flavor == TYPE_ATTRIB) {
+                if (const char *attr = db->p_type_val_to_name[i]) {
+                    if (first) {
+                        fprintf(fp, "type %s {", name);
+                        first = false;
                     }
+                    fprintf(fp, " %s", attr);
                 }
             }
         }
@@ -748,7 +891,32 @@ void sepol_impl::print_type(FILE *fp, type_datum_t *type) {
         }
     }
     if (ebitmap_get_bit(&db->permissive_map, type->s.value)) {
-        fprintf(stdout, "permissive %s\n", name);
+        fprintf(fp, "permissive %s\n", name);
+    }
+}
+
+static const char *avtab_rule_name(uint16_t specified) {
+    switch (specified) {
+        case AVTAB_ALLOWED:
+            return "allow";
+        case AVTAB_AUDITALLOW:
+            return "auditallow";
+        case AVTAB_AUDITDENY:
+            return "dontaudit";
+        case AVTAB_TRANSITION:
+            return "type_transition";
+        case AVTAB_MEMBER:
+            return "type_member";
+        case AVTAB_CHANGE:
+            return "type_change";
+        case AVTAB_XPERMS_ALLOWED:
+            return "allowxperm";
+        case AVTAB_XPERMS_AUDITALLOW:
+            return "auditallowxperm";
+        case AVTAB_XPERMS_DONTAUDIT:
+            return "dontauditxperm";
+        default:
+            return nullptr;
     }
 }
 
@@ -759,49 +927,23 @@ void sepol_impl::print_avtab(FILE *fp, avtab_ptr_t node) {
     if (src == nullptr || tgt == nullptr || cls == nullptr)
         return;
 
+    const char *name = avtab_rule_name(node->key.specified);
+    if (name == nullptr)
+        return;
+
     if (node->key.specified & AVTAB_AV) {
         uint32_t data = node->datum.data;
-        const char *name;
-        switch (node->key.specified) {
-            case AVTAB_ALLOWED:
-                name = "allow";
-                break;
-            case AVTAB_AUDITALLOW:
-                name = "auditallow";
-                break;
-            case AVTAB_AUDITDENY:
-                name = "dontaudit";
-                // Invert the rules for dontaudit
-                data = ~data;
-                break;
-            default:
-                return;
-        }
+        // Invert the rules for dontaudit
+        if (node->key.specified == AVTAB_AUDITDENY)
+            data = ~data;
 
-        class_datum_t *clz = db->class_val_to_struct[node->key.target_class - 1];
-        if (clz == nullptr)
-            return;
-
-        auto it = class_perm_names.find(cls);
-        if (it == class_perm_names.end()) {
-            it = class_perm_names.try_emplace(cls).first;
-            // Find all permission names and cache the value
-            hashtab_for_each(clz->permissions.table, [&](hashtab_ptr_t node) {
-                perm_datum_t *perm = auto_cast(node->datum);
-                it->second[perm->s.value - 1] = node->key;
-            });
-            if (clz->comdatum) {
-                hashtab_for_each(clz->comdatum->permissions.table, [&](hashtab_ptr_t node) {
-                    perm_datum_t *perm = auto_cast(node->datum);
-                    it->second[perm->s.value - 1] = node->key;
-                });
-            }
-        }
+        // Permission names have to be prepared with init_perm_names
+        const auto &perm_names = class_perm_names[node->key.target_class - 1];
 
         bool first = true;
         for (int i = 0; i < 32; ++i) {
             if (data & (1u << i)) {
-                if (const char *perm = it->second[i]) {
+                if (const char *perm = perm_names[i]) {
                     if (first) {
                         fprintf(fp, "%s %s %s %s {", name, src, tgt, cls);
                         first = false;
@@ -814,38 +956,10 @@ void sepol_impl::print_avtab(FILE *fp, avtab_ptr_t node) {
             fprintf(fp, " }\n");
         }
     } else if (node->key.specified & AVTAB_TYPE) {
-        const char *name;
-        switch (node->key.specified) {
-            case AVTAB_TRANSITION:
-                name = "type_transition";
-                break;
-            case AVTAB_MEMBER:
-                name = "type_member";
-                break;
-            case AVTAB_CHANGE:
-                name = "type_change";
-                break;
-            default:
-                return;
-        }
         if (const char *def = db->p_type_val_to_name[node->datum.data - 1]) {
             fprintf(fp, "%s %s %s %s %s\n", name, src, tgt, cls, def);
         }
     } else if (node->key.specified & AVTAB_XPERMS) {
-        const char *name;
-        switch (node->key.specified) {
-            case AVTAB_XPERMS_ALLOWED:
-                name = "allowxperm";
-                break;
-            case AVTAB_XPERMS_AUDITALLOW:
-                name = "auditallowxperm";
-                break;
-            case AVTAB_XPERMS_DONTAUDIT:
-                name = "dontauditxperm";
-                break;
-            default:
-                return;
-        }
         avtab_extended_perms_t *xperms = node->datum.xperms;
         if (xperms == nullptr)
             return;
@@ -892,7 +1006,7 @@ void sepol_impl::print_avtab(FILE *fp, avtab_ptr_t node) {
     }
 }
 
-void sepol_impl::print_filename_trans(FILE *fp, hashtab_ptr_t node) {
+void sepol_impl::print_filename_trans(FILE *fp, hashtab_ptr_t node, const vector<bool> &src_match) {
     auto key = reinterpret_cast<filename_trans_key_t *>(node->key);
     filename_trans_datum_t *trans = auto_cast(node->datum);
 
@@ -902,11 +1016,154 @@ void sepol_impl::print_filename_trans(FILE *fp, hashtab_ptr_t node) {
     if (tgt == nullptr || cls == nullptr || def == nullptr || key->name == nullptr)
         return;
 
-    for (uint32_t i = 0; i <= trans->stypes.highbit; ++i) {
-        if (ebitmap_get_bit(&trans->stypes, i)) {
-            if (const char *src = db->p_type_val_to_name[i]) {
-                fprintf(fp, "type_transition %s %s %s %s %s\n", src, tgt, cls, def, key->name);
+    ebitmap_node_t *n;
+    uint32_t i;
+    ebitmap_for_each_positive_bit(&trans->stypes, n, i) {
+        if (!src_match[i])
+            continue;
+        if (const char *src = db->p_type_val_to_name[i]) {
+            fprintf(fp, "type_transition %s %s %s %s %s\n", src, tgt, cls, def, key->name);
+        }
+    }
+}
+
+void sepol_impl::for_each_rule(const function<void(string_view)> &fn) {
+    init_perm_names();
+
+    char buf[4096];
+    auto emit = [&]<typename ...Args>(const char *fmt, Args ...args) {
+        int len = ssprintf(buf, sizeof(buf), fmt, args...);
+        fn(string_view(buf, len));
+    };
+
+    hashtab_for_each(db->p_types.table, [&](hashtab_ptr_t node) {
+        type_datum_t *type = auto_cast(node->datum);
+        const char *name = db->p_type_val_to_name[type->s.value - 1];
+        if (name == nullptr)
+            return;
+        if (type->flavor == TYPE_ATTRIB) {
+            emit("attribute %s", name);
+        } else if (type->flavor == TYPE_TYPE) {
+            emit("type %s", name);
+            ebitmap_node_t *n;
+            uint32_t i;
+            ebitmap_for_each_positive_bit(&db->type_attr_map[type->s.value - 1], n, i) {
+                if (db->type_val_to_struct[i]->flavor != TYPE_ATTRIB)
+                    continue;
+                if (const char *attr = db->p_type_val_to_name[i])
+                    emit("typeattribute %s %s", name, attr);
+            }
+        }
+        if (ebitmap_get_bit(&db->permissive_map, type->s.value))
+            emit("permissive %s", name);
+    });
+
+    // Every permission and ioctl is a separate rule, so the result does not
+    // depend on how rules are grouped into avtab nodes in each policy
+    hash_for_each(db->te_avtab.htable, db->te_avtab.nslot, [&](avtab_ptr_t node) {
+        const char *src = db->p_type_val_to_name[node->key.source_type - 1];
+        const char *tgt = db->p_type_val_to_name[node->key.target_type - 1];
+        const char *cls = db->p_class_val_to_name[node->key.target_class - 1];
+        const char *name = avtab_rule_name(node->key.specified);
+        if (src == nullptr || tgt == nullptr || cls == nullptr || name == nullptr)
+            return;
+
+        if (node->key.specified & AVTAB_AV) {
+            uint32_t data = node->datum.data;
+            if (node->key.specified == AVTAB_AUDITDENY)
+                data = ~data;
+            const auto &perm_names = class_perm_names[node->key.target_class - 1];
+            for (int i = 0; i < 32; ++i) {
+                if ((data & (1u << i)) && perm_names[i])
+                    emit("%s %s %s %s %s", name, src, tgt, cls, perm_names[i]);
+            }
+        } else if (node->key.specified & AVTAB_TYPE) {
+            if (const char *def = db->p_type_val_to_name[node->datum.data - 1])
+                emit("%s %s %s %s %s", name, src, tgt, cls, def);
+        } else if (node->key.specified & AVTAB_XPERMS) {
+            avtab_extended_perms_t *xperms = node->datum.xperms;
+            if (xperms == nullptr)
+                return;
+            for (int i = 0; i < 256; ++i) {
+                if (!xperm_test(i, xperms->perms))
+                    continue;
+                if (xperms->specified == AVTAB_XPERMS_IOCTLFUNCTION) {
+                    emit("%s %s %s %s ioctl 0x%04X", name, src, tgt, cls, (xperms->driver << 8) | i);
+                } else {
+                    emit("%s %s %s %s ioctl 0x%04X-0x%04X", name, src, tgt, cls, i << 8, (i << 8) | 0xFF);
+                }
+            }
+        }
+    });
+
+    hashtab_for_each(db->filename_trans, [&](hashtab_ptr_t node) {
+        auto key = reinterpret_cast<filename_trans_key_t *>(node->key);
+        const char *tgt = db->p_type_val_to_name[key->ttype - 1];
+        const char *cls = db->p_class_val_to_name[key->tclass - 1];
+        if (tgt == nullptr || cls == nullptr || key->name == nullptr)
+            return;
+        for (auto trans = static_cast<filename_trans_datum_t *>(node->datum); trans; trans = trans->next) {
+            const char *def = db->p_type_val_to_name[trans->otype - 1];
+            if (def == nullptr)
+                continue;
+            ebitmap_node_t *n;
+            uint32_t i;
+            ebitmap_for_each_positive_bit(&trans->stypes, n, i) {
+                if (const char *src = db->p_type_val_to_name[i])
+                    emit("type_transition %s %s %s %s %s", src, tgt, cls, def, key->name);
             }
         }
+    });
+
+    list_for_each(db->genfs, [&](genfs_t *genfs) {
+        list_for_each(genfs->head, [&](ocontext *context) {
+            char *ctx = nullptr;
+            size_t len = 0;
+            if (context_to_string(nullptr, db, &context->context[0], &ctx, &len) == 0) {
+                emit("genfscon %s %s %s", genfs->fstype, context->u.name, ctx);
+                free(ctx);
+            }
+        });
+    });
+}
+
+// 64-bit FNV-1a
+static uint64_t rule_hash(string_view rule) {
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (char c : rule) {
+        h ^= static_cast<uint8_t>(c);
+        h *= 0x100000001b3ULL;
     }
+    return h;
+}
+
+bool sepolicy::print_diff(sepolicy *other) {
+    auto a = impl;
+    auto b = reinterpret_cast<sepol_impl *>(other);
+
+    // Only keep sorted rule hashes in memory, and regenerate the rules when printing
+    auto collect = [](sepol_impl *sepol) {
+        vector<uint64_t> hashes;
+        sepol->for_each_rule([&](string_view rule) {
+            hashes.push_back(rule_hash(rule));
+        });
+        std::sort(hashes.begin(), hashes.end());
+        hashes.erase(std::unique(hashes.begin(), hashes.end()), hashes.end());
+        hashes.shrink_to_fit();
+        return hashes;
+    };
+
+    bool differ = false;
+    auto print_missing = [&](sepol_impl *sepol, const vector<uint64_t> &hashes, char sign) {
+        sepol->for_each_rule([&](string_view rule) {
+            if (!std::binary_search(hashes.begin(), hashes.end(), rule_hash(rule))) {
+                printf("%c %.*s\n", sign, (int) rule.size(), rule.data());
+                differ = true;
+            }
+        });
+    };
+
+    print_missing(a, collect(b), '-');
+    print_missing(b, collect(a), '+');
+    return differ;
 }